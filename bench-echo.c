@@ -0,0 +1,364 @@
+/* Loopback echo and RPC benchmark for the fiber I/O path of the asm backend.
+
+A server process runs one fiber per connection. A load generator process
+opens the requested number of connections, each driven by its own fiber,
+and sends requests back to back on every connection for a fixed time. It
+prints the requests per second and the latency percentiles.
+
+In echo mode the server writes back whatever it reads. In rpc mode every
+request and response is a 4-byte big-endian length followed by that many
+bytes, and the server reads a whole request before it responds.
+
+Usage: bench-echo [-m echo|rpc] [-c connections] [-s bytes] [-d seconds] */
+#include "libfiber-io.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined( LF_SHARED_STACK )
+#define STACKS "shared"
+#elif defined( LF_STACK_ARENA )
+#define STACKS "arena"
+#else
+#define STACKS "malloc"
+#endif
+
+/* The largest request, including the rpc length prefix */
+#define MAX_REQUEST 4096
+/* Client connections bound to each loopback source address, to stay well
+inside the ephemeral port range of one address */
+#define CONNECTIONS_PER_ADDRESS 16384
+
+static int rpc = 0;
+static int numConnections = 1000;
+static int requestSize = 64;
+static int seconds = 2;
+static struct sockaddr_in serverAddress;
+
+/* Load generator state */
+static int* clientIds;
+static int launcherId;
+static int numArrived = 0;
+static int numFailed = 0;
+static int running = 0;
+static int stopping = 0;
+static uint64_t* latencies;
+static size_t numLatencies = 0;
+static size_t latencyCapacity = 0;
+
+static uint64_t nowNanoseconds()
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Reads exactly count bytes. Returns 0 on end of file or error. */
+static int readFully( int fd, char* buffer, size_t count )
+{
+	while ( count > 0 )
+	{
+		ssize_t bytes = fiberRead( fd, buffer, count );
+		if ( bytes <= 0 ) return 0;
+		buffer += bytes;
+		count -= bytes;
+	}
+	return 1;
+}
+
+/* Writes exactly count bytes. Returns 0 on error. */
+static int writeFully( int fd, const char* buffer, size_t count )
+{
+	while ( count > 0 )
+	{
+		ssize_t bytes = fiberWrite( fd, buffer, count );
+		if ( bytes <= 0 ) return 0;
+		buffer += bytes;
+		count -= bytes;
+	}
+	return 1;
+}
+
+static void serveEcho( int fd )
+{
+	char buffer[ MAX_REQUEST ];
+	ssize_t bytes;
+	while ( (bytes = fiberRead( fd, buffer, sizeof(buffer) )) > 0 )
+	{
+		if ( ! writeFully( fd, buffer, bytes ) ) break;
+	}
+}
+
+static void serveRpc( int fd )
+{
+	char buffer[ MAX_REQUEST ];
+	uint32_t length;
+	while ( readFully( fd, buffer, 4 ) )
+	{
+		memcpy( &length, buffer, 4 );
+		length = ntohl( length );
+		if ( length > MAX_REQUEST - 4 || ! readFully( fd, buffer + 4, length ) ) break;
+		/* The request is its own response */
+		if ( ! writeFully( fd, buffer, 4 + length ) ) break;
+	}
+}
+
+static void serveConnection( void* arg )
+{
+	int fd = (int) (intptr_t) arg;
+	if ( rpc ) serveRpc( fd );
+	else serveEcho( fd );
+	close( fd );
+}
+
+static void acceptConnections( void* arg )
+{
+	int listener = (int) (intptr_t) arg;
+	int one = 1;
+	for ( ;; )
+	{
+		int fd = fiberAccept( listener, NULL, NULL );
+		if ( fd == -1 )
+		{
+			perror( "accept" );
+			continue;
+		}
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+		if ( spawnFiberWithArg( &serveConnection, (void*) (intptr_t) fd ) != LF_NOERROR )
+		{
+			close( fd );
+		}
+	}
+}
+
+static void recordLatency( uint64_t nanoseconds )
+{
+	if ( numLatencies == latencyCapacity )
+	{
+		latencyCapacity = latencyCapacity == 0 ? 1024*1024 : 2 * latencyCapacity;
+		latencies = (uint64_t*) realloc( latencies, latencyCapacity * sizeof(*latencies) );
+		if ( latencies == NULL ) abort();
+	}
+	latencies[ numLatencies ++ ] = nanoseconds;
+}
+
+/* Opens a connection to the server, using a source address chosen by index */
+static int openConnection( int index )
+{
+	struct sockaddr_in source;
+	int one = 1;
+	int fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if ( fd == -1 ) return -1;
+
+	memset( &source, 0, sizeof(source) );
+	source.sin_family = AF_INET;
+	source.sin_addr.s_addr = htonl( INADDR_LOOPBACK + index / CONNECTIONS_PER_ADDRESS );
+	/* Let connect pick the port, so ports are only unique per destination */
+	setsockopt( fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one) );
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+	if ( bind( fd, (struct sockaddr*) &source, sizeof(source) ) == -1 ||
+		fiberConnect( fd, (struct sockaddr*) &serverAddress, sizeof(serverAddress) ) == -1 )
+	{
+		close( fd );
+		return -1;
+	}
+	return fd;
+}
+
+static void runClient( void* arg )
+{
+	int index = (int) (intptr_t) arg;
+	char request[ MAX_REQUEST ];
+	char response[ MAX_REQUEST ];
+	size_t size = requestSize;
+	int fd = openConnection( index );
+
+	clientIds[index] = fiberSelf();
+	if ( fd == -1 ) ++ numFailed;
+	if ( ++ numArrived == numConnections ) fiberUnpark( launcherId );
+	if ( fd == -1 ) return;
+
+	memset( request, 'x', size );
+	if ( rpc )
+	{
+		uint32_t length = htonl( size - 4 );
+		memcpy( request, &length, 4 );
+	}
+
+	/* Wait until every connection is open */
+	while ( ! running ) fiberPark();
+
+	while ( ! stopping )
+	{
+		uint64_t start = nowNanoseconds();
+		if ( ! writeFully( fd, request, size ) || ! readFully( fd, response, size ) )
+		{
+			++ numFailed;
+			break;
+		}
+		if ( ! stopping ) recordLatency( nowNanoseconds() - start );
+	}
+	close( fd );
+}
+
+static void launchClients()
+{
+	int i;
+	uint64_t expirations;
+	struct itimerspec duration;
+	int timer = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	if ( timer == -1 )
+	{
+		perror( "timerfd_create" );
+		exit( 1 );
+	}
+
+	launcherId = fiberSelf();
+	for ( i = 0; i < numConnections; ++ i )
+	{
+		if ( spawnFiberWithArg( &runClient, (void*) (intptr_t) i ) != LF_NOERROR )
+		{
+			fprintf( stderr, "Could not spawn client %d\n", i );
+			exit( 1 );
+		}
+	}
+	while ( numArrived < numConnections ) fiberPark();
+
+	/* Measure for the given time, sleeping on a timerfd */
+	memset( &duration, 0, sizeof(duration) );
+	duration.it_value.tv_sec = seconds;
+	timerfd_settime( timer, 0, &duration, NULL );
+	running = 1;
+	for ( i = 0; i < numConnections; ++ i ) fiberUnpark( clientIds[i] );
+	fiberRead( timer, &expirations, sizeof(expirations) );
+	stopping = 1;
+	close( timer );
+}
+
+static int compareLatencies( const void* a, const void* b )
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return ( x > y ) - ( x < y );
+}
+
+/* Returns a percentile of the sorted latencies in microseconds */
+static double percentile( double fraction )
+{
+	size_t index = (size_t) ( fraction * numLatencies );
+	if ( numLatencies == 0 ) return 0;
+	if ( index >= numLatencies ) index = numLatencies - 1;
+	return latencies[index] / 1000.0;
+}
+
+/* Raises the descriptor limit so that count connections fit. */
+static int reserveDescriptors( int count )
+{
+	struct rlimit limit;
+	if ( getrlimit( RLIMIT_NOFILE, &limit ) == -1 ) return 0;
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit( RLIMIT_NOFILE, &limit );
+	if ( limit.rlim_cur < (rlim_t) count + 16 )
+	{
+		fprintf( stderr, "%d connections need %d descriptors per process, the limit is %ld\n",
+			count, count + 16, (long) limit.rlim_cur );
+		return 0;
+	}
+	return 1;
+}
+
+static void usage()
+{
+	fprintf( stderr, "usage: bench-echo [-m echo|rpc] [-c connections] [-s bytes] [-d seconds]\n" );
+	exit( 1 );
+}
+
+int main( int argc, char* argv[] )
+{
+	int option;
+	int listener;
+	int one = 1;
+	socklen_t addressLength = sizeof(serverAddress);
+	pid_t server;
+
+	while ( (option = getopt( argc, argv, "m:c:s:d:" )) != -1 )
+	{
+		switch ( option )
+		{
+		case 'm':
+			if ( strcmp( optarg, "rpc" ) == 0 ) rpc = 1;
+			else if ( strcmp( optarg, "echo" ) != 0 ) usage();
+			break;
+		case 'c': numConnections = atoi( optarg ); break;
+		case 's': requestSize = atoi( optarg ); break;
+		case 'd': seconds = atoi( optarg ); break;
+		default: usage();
+		}
+	}
+	if ( numConnections < 1 || seconds < 1 ||
+		requestSize < ( rpc ? 5 : 1 ) || requestSize > MAX_REQUEST ) usage();
+	if ( numConnections + 2 > MAX_FIBERS )
+	{
+		fprintf( stderr, "%d connections need MAX_FIBERS of at least %d, it is %d\n",
+			numConnections, numConnections + 2, MAX_FIBERS );
+		return 1;
+	}
+	if ( ! reserveDescriptors( numConnections ) ) return 1;
+
+	listener = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	memset( &serverAddress, 0, sizeof(serverAddress) );
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+	if ( listener == -1 ||
+		bind( listener, (struct sockaddr*) &serverAddress, sizeof(serverAddress) ) == -1 ||
+		listen( listener, SOMAXCONN ) == -1 ||
+		getsockname( listener, (struct sockaddr*) &serverAddress, &addressLength ) == -1 )
+	{
+		perror( "listen" );
+		return 1;
+	}
+
+	server = fork();
+	if ( server == -1 )
+	{
+		perror( "fork" );
+		return 1;
+	}
+	if ( server == 0 )
+	{
+		initFibers();
+		spawnFiberWithArg( &acceptConnections, (void*) (intptr_t) listener );
+		waitForAllFibers();
+		return 0;
+	}
+	close( listener );
+
+	clientIds = (int*) calloc( numConnections, sizeof(*clientIds) );
+	if ( clientIds == NULL ) return 1;
+	initFibers();
+	spawnFiber( &launchClients );
+	waitForAllFibers();
+	kill( server, SIGTERM );
+	waitpid( server, NULL, 0 );
+
+	qsort( latencies, numLatencies, sizeof(*latencies), &compareLatencies );
+	printf( "asm %s %s connections=%d size=%d requests/s=%.0f p50=%.1fus p99=%.1fus p999=%.1fus",
+		STACKS, rpc ? "rpc" : "echo", numConnections, requestSize,
+		(double) numLatencies / seconds,
+		percentile( 0.5 ), percentile( 0.99 ), percentile( 0.999 ) );
+	if ( numFailed > 0 ) printf( " failed=%d", numFailed );
+	printf( "\n" );
+	return numFailed > 0;
+}
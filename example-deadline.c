@@ -0,0 +1,76 @@
+#include "libfiber-io.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#define MILLISECOND 1000000LL
+
+static int pipeFds[2];
+static int sleeperId;
+
+/* Parks with a long deadline, but is woken long before it. */
+void sleeper()
+{
+	sleeperId = fiberSelf();
+	if ( fiberParkUntil( fiberNow() + 1000 * MILLISECOND ) == LF_NOERROR )
+	{
+		printf( "sleeper: woken before its deadline\n" );
+	}
+}
+
+void waker()
+{
+	fiberUnpark( sleeperId );
+}
+
+/* Parks until its deadline passes. */
+void napper()
+{
+	if ( fiberParkUntil( fiberNow() + 20 * MILLISECOND ) == LF_TIMEOUT )
+	{
+		printf( "napper: timed out\n" );
+	}
+}
+
+/* Inherits the request's deadline, so its read gives up with it. */
+void child()
+{
+	char byte;
+	if ( fiberRead( pipeFds[0], &byte, 1 ) == -1 && errno == ETIMEDOUT )
+	{
+		printf( "child: read timed out with the request's deadline\n" );
+	}
+}
+
+/* Sets a deadline for itself and the work it spawns. */
+void request()
+{
+	fiberSetDeadline( fiberNow() + 50 * MILLISECOND );
+	spawnFiber( &child );
+
+	/* A shorter deadline on one wait still applies */
+	if ( fiberShardReceiveUntil( fiberNow() + 30 * MILLISECOND ) == NULL )
+	{
+		printf( "request: no message before the deadline\n" );
+	}
+}
+
+int main()
+{
+	/* Nothing is ever written, so reads only end at a deadline */
+	if ( pipe( pipeFds ) == -1 ) return 1;
+	fcntl( pipeFds[0], F_SETFL, O_NONBLOCK );
+
+	initFibers();
+	spawnFiber( &sleeper );
+	spawnFiber( &waker );
+	spawnFiber( &napper );
+	spawnFiber( &request );
+	waitForAllFibers();
+
+	printf( "Fibers finished\n" );
+	return 0;
+}
@@ -0,0 +1,109 @@
+/* One fiber reads from a socket while another writes to it and blocks on a
+full buffer, so both wait on the same descriptor at once. A third fiber at
+the other end drains the writes, then replies to the reader. A second
+reader is turned away with EBUSY. Exits with 1 if a fiber does not get what
+it should; the deadline turns a lost wakeup into a failure instead of a
+hang. */
+#include "libfiber-io.h"
+#include <errno.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include <unistd.h>
+
+#define MILLISECOND 1000000LL
+/* Far more than the socket buffers hold */
+#define PAYLOAD_BYTES ( 1024 * 1024 )
+
+static int sockets[2];
+static char payload[ PAYLOAD_BYTES ];
+static int failures = 0;
+
+static void fail( const char* who, const char* what )
+{
+	printf( "%s: %s\n", who, what );
+	++ failures;
+}
+
+/* Waits for the reply while the writer is blocked on the same socket */
+void reader()
+{
+	char reply[8];
+	ssize_t bytes;
+
+	fiberSetDeadline( fiberNow() + 5000 * MILLISECOND );
+	bytes = fiberRead( sockets[0], reply, sizeof(reply) );
+	if ( bytes == -1 ) fail( "reader", "read failed" );
+	else printf( "reader: got a %d byte reply\n", (int) bytes );
+}
+
+/* Arrives while the reader is waiting */
+void secondReader()
+{
+	char byte;
+
+	fiberSetDeadline( fiberNow() + 5000 * MILLISECOND );
+	if ( fiberRead( sockets[0], &byte, 1 ) == -1 && errno == EBUSY )
+	{
+		printf( "second reader: turned away, the socket already has a reader\n" );
+	}
+	else fail( "second reader", "was not turned away" );
+}
+
+void writer()
+{
+	size_t written = 0;
+
+	fiberSetDeadline( fiberNow() + 5000 * MILLISECOND );
+	while ( written < PAYLOAD_BYTES )
+	{
+		ssize_t bytes = fiberWrite( sockets[0], payload + written, PAYLOAD_BYTES - written );
+		if ( bytes == -1 )
+		{
+			fail( "writer", "write failed" );
+			return;
+		}
+		written += bytes;
+	}
+	printf( "writer: wrote %d bytes\n", PAYLOAD_BYTES );
+}
+
+/* The other end: takes all of the payload, then answers the reader */
+void peer()
+{
+	static char buffer[ 64 * 1024 ];
+	size_t received = 0;
+
+	fiberSetDeadline( fiberNow() + 5000 * MILLISECOND );
+	while ( received < PAYLOAD_BYTES )
+	{
+		ssize_t bytes = fiberRead( sockets[1], buffer, sizeof(buffer) );
+		if ( bytes <= 0 )
+		{
+			fail( "peer", "read failed" );
+			return;
+		}
+		received += bytes;
+	}
+	if ( fiberWrite( sockets[1], "done", 4 ) != 4 ) fail( "peer", "reply failed" );
+}
+
+int main()
+{
+	if ( socketpair( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets ) == -1 )
+	{
+		perror( "socketpair" );
+		return 1;
+	}
+
+	initFibers();
+	spawnFiber( &reader );
+	spawnFiber( &secondReader );
+	spawnFiber( &writer );
+	spawnFiber( &peer );
+	waitForAllFibers();
+
+	close( sockets[0] );
+	close( sockets[1] );
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+/* Lists the fibers of a shard with fiberEnumerate while one of them runs,
+two are runnable and one is parked, the way a debugger or a stuck-request
+dump would. Exits with 1 if a fiber is listed in the wrong state. */
+#include "libfiber.h"
+#include <stdio.h>
+
+#define NUM_YIELDS 3
+
+/* The state each fiber should be listed in, -1 for fibers not spawned */
+static int expected[ MAX_FIBERS ];
+static int sleeperId = -1;
+static int woken = 0;
+static int mismatches = 0;
+
+static const char* stateName( int state )
+{
+	switch ( state )
+	{
+		case LF_FIBER_RUNNING: return "running";
+		case LF_FIBER_RUNNABLE: return "runnable";
+		case LF_FIBER_PARKED: return "parked";
+	}
+	return "unknown";
+}
+
+void printFiber( const fiberInfo* info, void* arg )
+{
+	int want = expected[ info->id ];
+	(void) arg;
+
+	printf( "Fiber %d: %s, %s\n", info->id, stateName( info->state ),
+		info->stackLow == NULL ? "no stack yet" : "has a stack" );
+	if ( info->state != want )
+	{
+		printf( "Fiber %d: expected %s\n", info->id, stateName( want ) );
+		++ mismatches;
+	}
+}
+
+void sleeper()
+{
+	sleeperId = fiberSelf();
+	expected[ sleeperId ] = LF_FIBER_PARKED;
+	while ( ! woken )
+	{
+		fiberPark();
+	}
+}
+
+void yielder()
+{
+	int i;
+	expected[ fiberSelf() ] = LF_FIBER_RUNNABLE;
+	for ( i = 0; i < NUM_YIELDS; ++ i )
+	{
+		fiberYield();
+	}
+}
+
+/* Runs after the others have started: the sleeper has parked and the
+yielders are waiting for their next turn. */
+void inspector()
+{
+	expected[ fiberSelf() ] = LF_FIBER_RUNNING;
+	fiberEnumerate( &printFiber, NULL );
+
+	woken = 1;
+	fiberUnpark( sleeperId );
+}
+
+int main()
+{
+	int i;
+	for ( i = 0; i < MAX_FIBERS; ++ i ) expected[i] = -1;
+
+	initFibers();
+	spawnFiber( &sleeper );
+	spawnFiber( &yielder );
+	spawnFiber( &yielder );
+	spawnFiber( &inspector );
+	waitForAllFibers();
+
+	printf( "%d fibers listed in the wrong state\n", mismatches );
+	return mismatches == 0 ? 0 : 1;
+}
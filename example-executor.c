@@ -0,0 +1,48 @@
+/* Runs many small tasks on a few executor workers instead of a fiber each,
+then stops the executor and checks that every task ran exactly once. Exits
+with 1 if one did not. */
+#include "libfiber.h"
+#include <stdio.h>
+
+#define NUM_WORKERS 4
+#define NUM_TASKS 1000
+
+static int runs[ NUM_TASKS ];
+static int running = 0;
+static int mostRunning = 0;
+
+/* Yields halfway, so other workers pick up tasks meanwhile */
+void task( void* arg )
+{
+	int* run = (int*) arg;
+
+	++ running;
+	if ( running > mostRunning ) mostRunning = running;
+	fiberYield();
+	++ *run;
+	-- running;
+}
+
+int main()
+{
+	int i;
+	int missed = 0;
+
+	initFibers();
+	fiberExecutorStart( NUM_WORKERS );
+	for ( i = 0; i < NUM_TASKS; ++ i )
+	{
+		fiberExecutorSubmit( &task, &runs[i] );
+	}
+	/* The workers finish the queued tasks before they exit */
+	fiberExecutorStop();
+	waitForAllFibers();
+
+	for ( i = 0; i < NUM_TASKS; ++ i )
+	{
+		if ( runs[i] != 1 ) ++ missed;
+	}
+	printf( "%d tasks on %d workers, at most %d at once: %d not run exactly once\n",
+		NUM_TASKS, NUM_WORKERS, mostRunning, missed );
+	return missed == 0 ? 0 : 1;
+}
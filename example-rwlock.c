@@ -0,0 +1,156 @@
+/* Moves money between two accounts on several shards under a fiberRWLock:
+writers take from one and, after yielding, add to the other, while readers
+check the total before and after yielding. The operations are tallied with
+fiberCounters. Then, on one thread, waits that time out: a writer behind a
+reader, which must not leave the reader queued behind it blocked, and a
+reader behind a writer. Exits with 1 on a broken total or an
+unexpected result. */
+#include "libfiber.h"
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define MILLISECOND 1000000LL
+#define NUM_SHARDS 4
+#define READERS_PER_SHARD 3
+#define NUM_READS 2000
+#define NUM_TRANSFERS 500
+#define TOTAL 1000
+
+static fiberRWLock lock;
+static long accounts[2] = { TOTAL, 0 };
+static fiberCounter reads;
+static fiberCounter transfers;
+static atomic_int failures = 0;
+
+static void fail( const char* what )
+{
+	printf( "%s\n", what );
+	atomic_fetch_add( &failures, 1 );
+}
+
+void reader()
+{
+	int i;
+	for ( i = 0; i < NUM_READS; ++ i )
+	{
+		fiberReadLock( &lock );
+		if ( accounts[0] + accounts[1] != TOTAL ) fail( "reader: saw a transfer in flight" );
+		fiberYield();
+		if ( accounts[0] + accounts[1] != TOTAL ) fail( "reader: saw a transfer in flight" );
+		fiberReadUnlock( &lock );
+		fiberCounterAdd( &reads, 1 );
+	}
+}
+
+/* Moves an amount back and forth, half of it in flight while it yields */
+void writer()
+{
+	int i;
+	for ( i = 0; i < NUM_TRANSFERS; ++ i )
+	{
+		int from = i % 2;
+		long amount = 1 + i % 10;
+		fiberWriteLock( &lock );
+		accounts[from] -= amount;
+		fiberYield();
+		accounts[1 - from] += amount;
+		fiberWriteUnlock( &lock );
+		fiberCounterAdd( &transfers, 1 );
+	}
+}
+
+/* Runs in every shard */
+void startShard()
+{
+	int i;
+	for ( i = 0; i < READERS_PER_SHARD; ++ i )
+	{
+		spawnFiber( &reader );
+	}
+	spawnFiber( &writer );
+}
+
+/* Holds the lock long enough for the others' deadlines to pass */
+void readHolder()
+{
+	fiberReadLock( &lock );
+	fiberParkUntil( fiberNow() + 20 * MILLISECOND );
+	fiberReadUnlock( &lock );
+}
+
+void writeHolder()
+{
+	fiberWriteLock( &lock );
+	fiberParkUntil( fiberNow() + 20 * MILLISECOND );
+	fiberWriteUnlock( &lock );
+}
+
+/* Gives up behind readHolder */
+void impatientWriter()
+{
+	if ( fiberWriteLockUntil( &lock, fiberNow() + 5 * MILLISECOND ) == LF_TIMEOUT )
+	{
+		printf( "writer: timed out behind a reader\n" );
+		return;
+	}
+	fail( "writer: got the lock while a reader held it" );
+	fiberWriteUnlock( &lock );
+}
+
+/* Queues behind impatientWriter, and must get in once it gives up */
+void queuedReader()
+{
+	if ( fiberReadLockUntil( &lock, fiberNow() + 10 * MILLISECOND ) == LF_NOERROR )
+	{
+		printf( "reader: got in once the waiting writer gave up\n" );
+		fiberReadUnlock( &lock );
+		return;
+	}
+	fail( "reader: stayed blocked by a writer that gave up" );
+}
+
+/* Gives up behind writeHolder */
+void impatientReader()
+{
+	if ( fiberReadLockUntil( &lock, fiberNow() + 5 * MILLISECOND ) == LF_TIMEOUT )
+	{
+		printf( "reader: timed out behind a writer\n" );
+		return;
+	}
+	fail( "reader: got the lock while a writer held it" );
+	fiberReadUnlock( &lock );
+}
+
+int main()
+{
+	long expectedReads = (long) NUM_SHARDS * READERS_PER_SHARD * NUM_READS;
+	long expectedTransfers = (long) NUM_SHARDS * NUM_TRANSFERS;
+
+	fiberRWLockInit( &lock );
+	fiberCounterInit( &reads );
+	fiberCounterInit( &transfers );
+	if ( runShards( NUM_SHARDS, &startShard ) != LF_NOERROR )
+	{
+		printf( "Could not run the shards\n" );
+		return 1;
+	}
+	printf( "%ld reads and %ld transfers on %d shards, total %ld\n",
+		fiberCounterRead( &reads ), fiberCounterRead( &transfers ), NUM_SHARDS,
+		accounts[0] + accounts[1] );
+	if ( fiberCounterRead( &reads ) != expectedReads ) fail( "some reads are missing" );
+	if ( fiberCounterRead( &transfers ) != expectedTransfers ) fail( "some transfers are missing" );
+	if ( accounts[0] + accounts[1] != TOTAL ) fail( "the total changed" );
+
+	/* The shards are gone, so this thread can run fibers of its own */
+	initFibers();
+	spawnFiber( &readHolder );
+	spawnFiber( &impatientWriter );
+	spawnFiber( &queuedReader );
+	waitForAllFibers();
+
+	spawnFiber( &writeHolder );
+	spawnFiber( &impatientReader );
+	waitForAllFibers();
+
+	return atomic_load( &failures ) == 0 ? 0 : 1;
+}
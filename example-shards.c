@@ -0,0 +1,57 @@
+#include "libfiber.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_SHARDS 4
+#define NUM_LAPS 3
+
+/* Passed from shard to shard around a ring */
+struct Token {
+	int hops;
+};
+
+/* Sends token to shard, yielding while the shard's ring from this shard is
+full until the shard has read enough to make room. */
+void sendToken( int shard, struct Token* token )
+{
+	while ( fiberShardSend( shard, token ) == LF_QUEUEFULL )
+	{
+		fiberYield();
+	}
+}
+
+/* Runs in every shard. Shard 0 starts the token, and each shard forwards it
+to the next one until it has gone around NUM_LAPS times. */
+void relay()
+{
+	int next = (fiberShard() + 1) % fiberShardCount();
+	int lastHop = NUM_LAPS * fiberShardCount();
+
+	if ( fiberShard() == 0 )
+	{
+		struct Token* token = (struct Token*) malloc( sizeof(*token) );
+		token->hops = 0;
+		sendToken( next, token );
+	}
+
+	for ( ;; )
+	{
+		struct Token* token = (struct Token*) fiberShardReceive();
+		int hops = ++ token->hops;
+		printf( "Shard %d got the token, hop %d\n", fiberShard(), hops );
+
+		if ( hops == lastHop )
+		{
+			free( token );
+			return;
+		}
+		/* The token belongs to the next shard once it is sent */
+		sendToken( next, token );
+		if ( hops + fiberShardCount() > lastHop ) return;
+	}
+}
+
+int main()
+{
+	return runShards( NUM_SHARDS, &relay );
+}
@@ -0,0 +1,63 @@
+/* Blocks SIGUSR1 in a fiber spawned with LF_OWN_SIGMASK, and checks across
+several switches that it stays blocked there and nowhere else. Only the
+ucontext backend implements spawnFiberWithFlags. Exits with 1 if a fiber
+sees the wrong mask. */
+#include "libfiber.h"
+#include <signal.h>
+#include <stdio.h>
+
+#define NUM_YIELDS 3
+
+static int mismatches = 0;
+
+static int isBlocked( int signal )
+{
+	sigset_t mask;
+	sigprocmask( SIG_BLOCK, NULL, &mask );
+	return sigismember( &mask, signal );
+}
+
+static void checkMask( const char* who, int wantBlocked )
+{
+	int blocked = isBlocked( SIGUSR1 );
+	printf( "%s: SIGUSR1 %s\n", who, blocked ? "blocked" : "not blocked" );
+	if ( blocked != wantBlocked ) ++ mismatches;
+}
+
+/* Its mask is saved and restored on every switch, so the block stays here */
+void guarded()
+{
+	int i;
+	sigset_t mask;
+	sigemptyset( &mask );
+	sigaddset( &mask, SIGUSR1 );
+	sigprocmask( SIG_BLOCK, &mask, NULL );
+
+	for ( i = 0; i < NUM_YIELDS; ++ i )
+	{
+		fiberYield();
+		checkMask( "Fiber with its own mask", 1 );
+	}
+}
+
+/* Switches without touching the mask, so it sees the thread's */
+void plain()
+{
+	int i;
+	for ( i = 0; i < NUM_YIELDS; ++ i )
+	{
+		checkMask( "Fiber sharing the mask", 0 );
+		fiberYield();
+	}
+}
+
+int main()
+{
+	initFibers();
+	spawnFiberWithFlags( &guarded, LF_OWN_SIGMASK );
+	spawnFiber( &plain );
+	waitForAllFibers();
+
+	checkMask( "Main", 0 );
+	return mismatches == 0 ? 0 : 1;
+}
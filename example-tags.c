@@ -0,0 +1,86 @@
+/* Runs two kinds of work under their own tags, light fibers that only yield
+and heavy ones that spin and keep a deep stack, and reads what each kind
+uses with fiberGetTagUsage, the way a server would decide whether to admit
+more of a kind. Exits with 1 if the heavy tag does not show more of both. */
+#include "libfiber.h"
+#include <stdio.h>
+#include <string.h>
+
+#define MILLISECOND 1000000LL
+#define TAG_LIGHT 1
+#define TAG_HEAVY 2
+#define FIBERS_PER_TAG 2
+#define NUM_ROUNDS 4
+/* Fits in the smaller stacks of LF_STACK_ARENA */
+#define HEAVY_FRAME_BYTES ( 32 * 1024 )
+
+static int passed = 0;
+
+void light( void* arg )
+{
+	int i;
+	(void) arg;
+	for ( i = 0; i < NUM_ROUNDS; ++ i )
+	{
+		fiberYield();
+	}
+}
+
+/* Yields with a large frame live, so its stack pages stay in use */
+void heavy( void* arg )
+{
+	volatile char frame[ HEAVY_FRAME_BYTES ];
+	int i;
+	(void) arg;
+
+	for ( i = 0; i < NUM_ROUNDS; ++ i )
+	{
+		long long until = fiberNow() + MILLISECOND;
+		memset( (char*) frame, i, sizeof(frame) );
+		while ( fiberNow() < until ) {}
+		fiberYield();
+	}
+}
+
+static void printUsage( const char* name, const fiberTagUsage* usage )
+{
+	printf( "%s: %d fibers, %lld us running, %lld KB of stack\n", name,
+		usage->fibers, usage->cpuNanoseconds / 1000, usage->stackBytes / 1024 );
+}
+
+/* Spawned last, so the others have all run once before it looks */
+void monitor()
+{
+	fiberTagUsage lightUsage;
+	fiberTagUsage heavyUsage;
+
+	fiberYield();
+	fiberGetTagUsage( TAG_LIGHT, &lightUsage );
+	fiberGetTagUsage( TAG_HEAVY, &heavyUsage );
+	printUsage( "light", &lightUsage );
+	printUsage( "heavy", &heavyUsage );
+
+	passed = lightUsage.fibers == FIBERS_PER_TAG && heavyUsage.fibers == FIBERS_PER_TAG &&
+		heavyUsage.cpuNanoseconds > lightUsage.cpuNanoseconds;
+#ifdef LF_STACK_ARENA
+	/* Huge pages can make every arena stack resident in full */
+	passed = passed && heavyUsage.stackBytes >= lightUsage.stackBytes;
+#else
+	passed = passed && heavyUsage.stackBytes > lightUsage.stackBytes;
+#endif
+	printf( "%s\n", passed ? "heavy uses more" : "unexpected usage" );
+}
+
+int main()
+{
+	int i;
+	initFibers();
+	for ( i = 0; i < FIBERS_PER_TAG; ++ i )
+	{
+		spawnFiberTagged( &light, NULL, TAG_LIGHT );
+		spawnFiberTagged( &heavy, NULL, TAG_HEAVY );
+	}
+	spawnFiber( &monitor );
+	waitForAllFibers();
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+/* Traces a few fibers twice, first every one of them and then one in two,
+and writes each trace as Chrome trace-event JSON (trace-all.json and
+trace-sampled.json). Exits with 1 if a trace does not hold the fibers it
+should. */
+#include "libfiber.h"
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_FIBERS 4
+#define NUM_YIELDS 3
+
+void worker()
+{
+	int i;
+	for ( i = 0; i < NUM_YIELDS; ++ i )
+	{
+		fiberYield();
+	}
+}
+
+/* Returns the number of fibers with events in the trace at path, or -1 if
+it cannot be read. Each event is on a line of its own. */
+static int countTracedFibers( const char* path )
+{
+	char line[256];
+	int seen[ MAX_FIBERS ] = { 0 };
+	int count = 0;
+	FILE* in = fopen( path, "r" );
+	if ( in == NULL ) return -1;
+
+	while ( fgets( line, sizeof(line), in ) != NULL )
+	{
+		const char* tid = strstr( line, "\"tid\":" );
+		int fiber;
+		if ( tid != NULL && sscanf( tid, "\"tid\":%d", &fiber ) == 1 &&
+			0 <= fiber && fiber < MAX_FIBERS && ! seen[fiber] )
+		{
+			seen[fiber] = 1;
+			++ count;
+		}
+	}
+	fclose( in );
+	return count;
+}
+
+/* Runs the fibers with tracing on and checks the dump. Returns 0 if it does
+not hold events from exactly expected fibers. */
+static int traceFibers( int sampleEvery, const char* path, int expected )
+{
+	int i;
+	int traced;
+
+	fiberTraceStart( sampleEvery );
+	for ( i = 0; i < NUM_FIBERS; ++ i )
+	{
+		spawnFiber( &worker );
+	}
+	waitForAllFibers();
+	fiberTraceStop();
+
+	if ( fiberTraceDump( path ) != LF_NOERROR )
+	{
+		printf( "%s: could not be written\n", path );
+		return 0;
+	}
+	traced = countTracedFibers( path );
+	printf( "%s: %d of %d fibers traced\n", path, traced, NUM_FIBERS );
+	return traced == expected;
+}
+
+int main()
+{
+	int passed;
+	initFibers();
+
+	passed = traceFibers( 1, "trace-all.json", NUM_FIBERS );
+	/* Spawn order picks the sampled fibers: the first and third here */
+	passed = traceFibers( 2, "trace-sampled.json", NUM_FIBERS / 2 ) && passed;
+	return passed ? 0 : 1;
+}
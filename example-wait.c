@@ -0,0 +1,151 @@
+/* Waits on addresses with fiberWait: woken by an OS thread that is not
+running fibers, timing out and leaving nothing behind, and sharing a bucket
+of the wait table with another address without being woken for it. Exits
+with 1 if a fiber is woken when it should not be, or not when it should. */
+#include "libfiber.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <unistd.h>
+
+#define MILLISECOND 1000000LL
+/* As in libfiber-asm.c */
+#define WAIT_BUCKETS 256
+
+/* Set by the thread once its work is done */
+static atomic_int ready = 0;
+/* Set by the fiber just before it waits for ready */
+static atomic_int waiting = 0;
+/* Never changes, so waiting on it times out */
+static atomic_int never = 0;
+/* Two of these hash to the same bucket, one more than there are buckets */
+static atomic_int candidates[ WAIT_BUCKETS + 1 ];
+static atomic_int* first;
+static atomic_int* second;
+static int secondWoken = 0;
+static int failures = 0;
+
+static void fail( const char* what )
+{
+	printf( "%s\n", what );
+	++ failures;
+}
+
+/* Picks a bucket the way libfiber-asm.c does */
+static int bucketOf( const atomic_int* address )
+{
+	return (int) ( ( (uint64_t) (uintptr_t) address * 0x9e3779b97f4a7c15ULL ) >> 56 );
+}
+
+/* Plays the part of an OS thread finishing blocking work */
+void* worker( void* arg )
+{
+	int woken;
+	(void) arg;
+
+	while ( ! atomic_load( &waiting ) ) usleep( 1000 );
+	usleep( 10000 );
+	atomic_store( &ready, 1 );
+	woken = fiberWake( &ready, 1 );
+	printf( "thread: woke %d fiber\n", woken );
+	return NULL;
+}
+
+void threadWaiter()
+{
+	fiberSetDeadline( fiberNow() + 5000 * MILLISECOND );
+	atomic_store( &waiting, 1 );
+	while ( ! atomic_load( &ready ) )
+	{
+		if ( fiberWait( &ready, 0, 0 ) == LF_TIMEOUT )
+		{
+			fail( "fiber: the thread's wake never came" );
+			return;
+		}
+	}
+	printf( "fiber: woken by the thread\n" );
+}
+
+void timingOut()
+{
+	if ( fiberWait( &never, 0, fiberNow() + 5 * MILLISECOND ) != LF_TIMEOUT )
+	{
+		fail( "fiber: the wait did not time out" );
+	}
+	/* Nothing is left waiting to be woken */
+	else if ( fiberWake( &never, 1 ) != 0 ) fail( "fiber: the timed out wait was still queued" );
+	else printf( "fiber: timed out, and left the bucket\n" );
+}
+
+void firstWaiter()
+{
+	while ( ! atomic_load( first ) )
+	{
+		fiberWait( first, 0, 0 );
+	}
+}
+
+void secondWaiter()
+{
+	while ( ! atomic_load( second ) )
+	{
+		fiberWait( second, 0, 0 );
+	}
+	secondWoken = 1;
+}
+
+/* Runs once both waiters are parked in the same bucket */
+void bucketWaker()
+{
+	int i;
+
+	atomic_store( first, 1 );
+	if ( fiberWake( first, 2 ) != 1 ) fail( "fiber: did not wake just the first waiter" );
+	for ( i = 0; i < 3; ++ i )
+	{
+		fiberYield();
+	}
+	if ( secondWoken ) fail( "fiber: the second waiter woke for the first address" );
+	else printf( "fiber: woke one of two waiters sharing bucket %d\n", bucketOf( first ) );
+
+	atomic_store( second, 1 );
+	if ( fiberWake( second, 1 ) != 1 ) fail( "fiber: did not wake the second waiter" );
+}
+
+int main()
+{
+	int i;
+	int j;
+	pthread_t thread;
+
+	/* By the pigeonhole principle, two of the candidates share a bucket */
+	for ( i = 0; i < WAIT_BUCKETS && first == NULL; ++ i )
+	{
+		for ( j = i + 1; j <= WAIT_BUCKETS; ++ j )
+		{
+			if ( bucketOf( &candidates[i] ) == bucketOf( &candidates[j] ) )
+			{
+				first = &candidates[i];
+				second = &candidates[j];
+				break;
+			}
+		}
+	}
+
+	initFibers();
+	spawnFiber( &threadWaiter );
+	spawnFiber( &timingOut );
+	pthread_create( &thread, NULL, &worker, NULL );
+	/* Sleeps in the scheduler while every fiber is parked */
+	waitForAllFibers();
+	pthread_join( thread, NULL );
+
+	spawnFiber( &firstWaiter );
+	spawnFiber( &secondWaiter );
+	spawnFiber( &bucketWaker );
+	waitForAllFibers();
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+#include "libfiber.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include <unistd.h>
+
+#define NUM_WAITERS 3
+
+/* Fiber ids published for the "disk" thread, -1 until the fiber is ready */
+static atomic_int waiters[ NUM_WAITERS ];
+/* Set by the disk thread once it has completed the request */
+static atomic_int done[ NUM_WAITERS ];
+
+void waiter()
+{
+	int slot = 0;
+	while ( atomic_load( &waiters[slot] ) != -1 ) ++ slot;
+
+	printf( "Fiber %d waiting for the disk thread\n", fiberSelf() );
+	atomic_store( &waiters[slot], fiberSelf() );
+	while ( ! atomic_load( &done[slot] ) )
+	{
+		fiberPark();
+	}
+	printf( "Fiber %d woken up\n", fiberSelf() );
+}
+
+/* Plays the part of an OS thread finishing blocking work. */
+void* diskThread( void* arg )
+{
+	int i;
+	(void) arg;
+
+	for ( i = 0; i < NUM_WAITERS; ++ i )
+	{
+		int fiber;
+		while ( (fiber = atomic_load( &waiters[i] )) == -1 ) usleep( 1000 );
+
+		usleep( 10000 );
+		atomic_store( &done[i], 1 );
+		fiberWakeup( fiber );
+	}
+	return NULL;
+}
+
+int main()
+{
+	int i;
+	pthread_t thread;
+
+	initFibers();
+	for ( i = 0; i < NUM_WAITERS; ++ i )
+	{
+		atomic_store( &waiters[i], -1 );
+		spawnFiber( &waiter );
+	}
+
+	pthread_create( &thread, NULL, &diskThread, NULL );
+	/* Sleeps in the scheduler while every fiber is parked */
+	waitForAllFibers();
+	pthread_join( thread, NULL );
+
+	return 0;
+}
@@ -0,0 +1,184 @@
+/* Measures the memory held by idle fibers: spawns N fibers, runs each until
+it is idle, then reports what the process gained in resident memory,
+virtual memory and page tables (VmRSS, VmSize and VmPTE from
+/proc/self/status), divided by N, and how long spawning and starting took.
+
+With the asm backend idle fibers are parked, as fibers waiting for I/O are.
+The other backends have no parking, so their idle fibers yield in a loop.
+
+Usage: footprint [-m max-resident-bytes-per-fiber] fibers
+Exits with 1 if the resident bytes per fiber exceed the maximum, and with 2
+if not all the fibers could be spawned. */
+#include "libfiber.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined( LF_BACKEND_UC )
+#define BACKEND "uc"
+#elif defined( LF_BACKEND_SJLJ )
+#define BACKEND "sjlj"
+#elif defined( LF_BACKEND_CLONE )
+#define BACKEND "clone"
+#else
+#define BACKEND "asm"
+#endif
+
+#if defined( LF_SHARED_STACK )
+#define STACKS "shared"
+#elif defined( LF_STACK_ARENA )
+#define STACKS "arena"
+#else
+#define STACKS "malloc"
+#endif
+
+/* Sizes from /proc/self/status, in kB */
+typedef struct
+{
+	long resident;
+	long virtualSize;
+	long pageTables;
+} memoryUsage;
+
+static volatile int done = 0;
+static int numIdle = 0;
+#ifdef LF_BACKEND_ASM
+static int* fiberIds;
+#endif
+
+static void readMemoryUsage( memoryUsage* usage )
+{
+	char line[256];
+	FILE* status = fopen( "/proc/self/status", "r" );
+	memset( usage, 0, sizeof(*usage) );
+	if ( status == NULL ) return;
+
+	while ( fgets( line, sizeof(line), status ) != NULL )
+	{
+		sscanf( line, "VmRSS: %ld", &usage->resident );
+		sscanf( line, "VmSize: %ld", &usage->virtualSize );
+		sscanf( line, "VmPTE: %ld", &usage->pageTables );
+	}
+	fclose( status );
+}
+
+static double nowMilliseconds()
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static void idleFiber()
+{
+#ifdef LF_BACKEND_ASM
+	fiberIds[ numIdle ] = fiberSelf();
+#endif
+	++ numIdle;
+	while ( ! done )
+	{
+#ifdef LF_BACKEND_ASM
+		fiberPark();
+#else
+		fiberYield();
+#endif
+	}
+}
+
+static void usage()
+{
+	fprintf( stderr, "usage: footprint [-m max-resident-bytes-per-fiber] fibers\n" );
+	exit( 1 );
+}
+
+int main( int argc, char* argv[] )
+{
+	int option;
+	int fibers;
+	int spawned;
+	long maximum = 0;
+	double start;
+	double spawnTime;
+	double startTime;
+	double resident;
+	memoryUsage before;
+	memoryUsage after;
+
+	while ( (option = getopt( argc, argv, "m:" )) != -1 )
+	{
+		if ( option == 'm' ) maximum = atol( optarg );
+		else usage();
+	}
+	if ( optind != argc - 1 ) usage();
+	fibers = atoi( argv[optind] );
+	if ( fibers < 1 ) usage();
+	if ( fibers > MAX_FIBERS )
+	{
+		fprintf( stderr, "%d fibers need MAX_FIBERS of at least %d, it is %d\n",
+			fibers, fibers, MAX_FIBERS );
+		return 2;
+	}
+
+	initFibers();
+#ifdef LF_BACKEND_ASM
+	fiberIds = (int*) malloc( fibers * sizeof(*fiberIds) );
+	if ( fiberIds == NULL ) return 2;
+#endif
+	readMemoryUsage( &before );
+
+	start = nowMilliseconds();
+	for ( spawned = 0; spawned < fibers; ++ spawned )
+	{
+		if ( spawnFiber( &idleFiber ) != LF_NOERROR ) break;
+	}
+	spawnTime = nowMilliseconds() - start;
+
+	/* Run every fiber once, which gives it its stack */
+	start = nowMilliseconds();
+	while ( numIdle < spawned )
+	{
+		int previous = numIdle;
+		fiberYield();
+#ifdef LF_BACKEND_ASM
+		/* Only fibers that have not run are runnable, so each dispatch
+		starts one, unless its stack could not be allocated */
+		if ( numIdle == previous ) break;
+#else
+		(void) previous;
+#endif
+	}
+	startTime = nowMilliseconds() - start;
+	readMemoryUsage( &after );
+
+	resident = ( after.resident - before.resident ) * 1024.0 / spawned;
+	printf( "%s %s fibers=%d spawn=%.1fms start=%.1fms resident/fiber=%.0f "
+		"virtual/fiber=%.0f pagetables/fiber=%.1f\n",
+		BACKEND, STACKS, spawned, spawnTime, startTime, resident,
+		( after.virtualSize - before.virtualSize ) * 1024.0 / spawned,
+		( after.pageTables - before.pageTables ) * 1024.0 / spawned );
+
+	done = 1;
+#ifdef LF_BACKEND_ASM
+	{
+		int i;
+		for ( i = 0; i < numIdle; ++ i ) fiberUnpark( fiberIds[i] );
+	}
+#endif
+	waitForAllFibers();
+
+	if ( spawned < fibers || numIdle < spawned )
+	{
+		fprintf( stderr, "Only %d of %d fibers could be started\n", numIdle, fibers );
+		return 2;
+	}
+	if ( maximum > 0 && resident > maximum )
+	{
+		fprintf( stderr, "%s %s: %.0f resident bytes per idle fiber, the limit is %ld\n",
+			BACKEND, STACKS, resident, maximum );
+		return 1;
+	}
+	return 0;
+}
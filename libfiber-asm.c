@@ -1,133 +1,2111 @@
+#define _GNU_SOURCE /* For CPU_SET and pthread_setaffinity_np */
+
+#ifndef LF_BACKEND_ASM
+#define LF_BACKEND_ASM 1
+#endif
 #include "libfiber.h"
+#include "libfiber-io.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/epoll.h> /* For fiber I/O */
+#include <sys/eventfd.h> /* For the wakeup doorbell */
+#include <sys/mman.h> /* For the stack arena */
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h> /* For __rdtsc */
+
+/* Number of stacks kept for reuse by each scheduler */
+#define STACK_POOL_SIZE 64
+
+#ifdef LF_STACK_ARENA
+#ifdef LF_SHARED_STACK
+#error "LF_STACK_ARENA and LF_SHARED_STACK cannot be used together"
+#endif
+/* The size of each fiber's stack */
+#define STACK_SIZE ARENA_STACK
+/* Bytes left unused below each arena stack. Protecting them would split
+the huge pages, so instead a canary at the top of each gap is checked when
+the stack is released. */
+#define ARENA_GUARD 4096
+#define ARENA_SLOT ( ARENA_STACK + ARENA_GUARD )
+/* The number of stacks in the arena: no more than can be in use at once */
+#define ARENA_SLOTS ( MAX_FIBERS < ARENA_STACKS ? MAX_FIBERS : ARENA_STACKS )
+#define ARENA_CANARY_WORDS 4
+#define ARENA_CANARY ( (uintptr_t) 0x5afe57acU )
+#define HUGE_PAGE_SIZE ( 2*1024*1024 )
+#else
+/* The size of each fiber's stack */
+#define STACK_SIZE FIBER_STACK
+#endif
+
+/* The epoll_event.data of the doorbell. Descriptors fibers wait on carry
+the descriptor instead. */
+#define DOORBELL_KEY UINT64_MAX
+/* The most events taken from epoll at once */
+#define MAX_IO_EVENTS 64
+
+/* Values for fiber.state */
+#define FIBER_FREE	0
+#define FIBER_RUNNABLE	1
+#define FIBER_PARKED	2
+#define FIBER_EXITED	3
+
+/* A FIFO of parked fibers of one scheduler, linked through the fibers'
+waitNext and waitPrev slot indexes. -1 marks the ends. */
+typedef struct
+{
+	int head;
+	int tail;
+} waitQueue;
+
+/* The slots of the fibers waiting for one descriptor to be readable and to
+be writable, -1 for none. They share the descriptor's epoll registration,
+armed for the events of both. */
+typedef struct
+{
+	int reader;
+	int writer;
+} ioWaiters;
+
+/* A task queued with fiberExecutorSubmit */
+typedef struct
+{
+	void (*function)(void*);
+	void* arg;
+	/* The submitter's deadline, which the task runs with */
+	long long deadline;
+} task;
+
+/* The Fiber Structure
+*  Contains the information about individual fibers.
+*/
+typedef struct fiber
+{
+	void** stack; /* The stack pointer, NULL until the fiber first runs */
+	void* stack_bottom; /* The original returned from malloc. */
+#ifdef LF_SHARED_STACK
+	/* stack_bottom holds a copy of the fiber's part of the shared stack,
+	from stack to the top. This is the size of that buffer. */
+	size_t savedCapacity;
+#endif
+	int state;
+	/* The entry point recorded by spawn. Only one of the functions is set. */
+	void (*function)(void);
+	void (*functionWithArg)(void*);
+	void* arg;
+	/* Set by fiberUnpark when the fiber was not parked, so the next
+	fiberPark returns immediately instead of losing the wakeup. */
+	int wakePending;
+	/* The queue the fiber is parked on, or NULL */
+	waitQueue* waitingOn;
+	int waitNext;
+	int waitPrev;
+	/* The deadline the fiber's waits are bounded by, inherited at spawn.
+	0 for none. */
+	long long deadline;
+	/* While parked with a deadline: when it expires, and the fiber's index
+	in the scheduler's timer heap (-1 when not in it) */
+	long long timerDeadline;
+	int timerIndex;
+	/* Set when the fiber was woken because its deadline expired */
+	int timedOut;
+	/* The accounting tag its run time and stack are charged to */
+	int tag;
+	/* The number of fibers the scheduler spawned before this one, which
+	decides whether tracing samples it */
+	unsigned int spawnNumber;
+	/* Link in the cross-thread wakeup inbox. These two fields are left alone
+	when a slot is reused, since another thread may still be pushing it. */
+	struct fiber* nextWakeup;
+	atomic_int wakeQueued;
+	/* Links in the waiter list of a fiberRWLock or fiberWait bucket, as
+	fiber ids, since the waiters can be on any shard. Guarded by the list's
+	guard. */
+	int lockNext;
+	int lockPrev;
+	/* Non-zero while the fiber is in a lock's waiter list */
+	atomic_int lockQueued;
+	/* The address the fiber waits on in fiberWait */
+	atomic_int* waitAddress;
+} fiber;
+
+/* Single producer, single consumer queue carrying messages from one shard to
+another. The indexes are on separate cache lines so the two threads do not
+share a line on the fast path. */
+typedef struct
+{
+	_Alignas(64) atomic_uint head; /* Next slot to read, written by the consumer */
+	_Alignas(64) atomic_uint tail; /* Next slot to write, written by the producer */
+	void* messages[ SHARD_RING_SIZE ];
+} shardRing;
+
+/* All the state of one scheduler. Each thread running fibers has its own, and
+nothing in here is touched by other threads except the atomic fields. */
+typedef struct
+{
+	/* The index of this scheduler in shards[] */
+	int shard;
+
+	/* The fiber table. Slots never move, so an index identifies a fiber for
+	as long as it lives. */
+	fiber fiberList[ MAX_FIBERS ];
+	/* Stack of unused slots in fiberList */
+	int freeSlots[ MAX_FIBERS ];
+	int numFree;
+
+	/* Ring buffer of runnable fibers, in the order they will be dispatched.
+	A fiber is in here at most once, so MAX_FIBERS entries are enough. */
+	int runQueue[ MAX_FIBERS ];
+	int runHead;
+	int runCount;
+
+	/* Binary min-heap of the fibers parked with a deadline, ordered by
+	timerDeadline */
+	int timerHeap[ MAX_FIBERS ];
+	int numTimers;
+
+	/* Per accounting tag: the live fibers, and the TSC ticks they ran for */
+	int tagFibers[ MAX_TAGS ];
+	uint64_t tagTicks[ MAX_TAGS ];
+	/* Non-zero once a tagged fiber has been spawned. Only then are
+	switches timed. */
+	int accounting;
+	/* TSC and time when accounting started, to convert ticks to time */
+	uint64_t accountingStartTsc;
+	long long accountingStartTime;
+
+	/* The index of the currently executing fiber */
+	int currentFiber;
+	/* A boolean flag indicating if we are in the main process or if we are in a fiber */
+	int inFiber;
+	/* The number of active fibers */
+	int numFibers;
+	/* The number of fibers ever spawned */
+	unsigned int numSpawned;
+	/* Set when a fiber was dropped because its stack could not be
+	allocated, until waitForAllFibers reports it */
+	int startFailed;
+
+	/* Stores the "main" fiber. */
+	fiber mainFiber;
+
+	/* Stacks of exited fibers, kept for reuse */
+	void* stackPool[ STACK_POOL_SIZE ];
+	int numPooledStacks;
+
+#ifdef LF_STACK_ARENA
+	/* ARENA_SLOTS stacks packed into one huge-page-backed region,
+	reserved when the first fiber runs. NULL if that failed. */
+	char* arena;
+	size_t arenaBytes;
+	int arenaReserved; /* Non-zero once the reservation was attempted */
+	/* Number of slots that have ever been handed out */
+	int arenaUsed;
+	/* Stack of released slots */
+	int* arenaFree;
+	int numArenaFree;
+#endif
+
+#ifdef LF_SHARED_STACK
+	/* Every fiber of this scheduler runs on this stack of FIBER_STACK bytes */
+	void* sharedStack;
+	/* The fiber whose frames are currently on sharedStack, or -1 */
+	int stackOwner;
+#endif
+
+	/* Wakeups posted by other threads: a lock-free stack pushed by any
+	thread and emptied all at once by the scheduler. */
+	fiber* _Atomic wakeupInbox;
+	/* Non-zero while the scheduler is blocked waiting for a wakeup. */
+	atomic_int sleeping;
+	/* eventfd written by other threads to interrupt the idle wait */
+	int doorbell;
+	/* Watches the doorbell and the descriptors fibers are waiting on */
+	int epollFd;
+	/* Number of fibers parked in waitForDescriptor */
+	int numIoWaiters;
+	/* The fibers waiting for each descriptor, indexed by descriptor and
+	grown to fit the largest one waited on */
+	ioWaiters* ioWaiters;
+	int ioWaitersSize;
+	/* Fibers left to dispatch before checking for I/O again */
+	int pollCountdown;
+
+	/* Messages from every other shard, indexed by the sending shard */
+	shardRing* inbound;
+	/* Set by senders when they add a message to one of the inbound rings */
+	atomic_int mailPending;
+	/* Fibers parked in fiberShardReceive */
+	waitQueue mailWaiters;
+
+	/* Tasks for the executor's workers: a ring buffer that grows as needed */
+	task* tasks;
+	int taskHead;
+	int numTasks;
+	int taskCapacity;
+	/* Workers parked because there were no tasks */
+	waitQueue idleWorkers;
+	/* Set by fiberExecutorStop: workers exit once the tasks run out */
+	int stopWorkers;
+} scheduler;
+
+/* The scheduler owned by the calling thread */
+static __thread scheduler* sched = NULL;
+
+/* Every scheduler, so other threads can post wakeups and messages to it. A
+fiber id is shard * MAX_FIBERS + the fiber's slot in that shard. */
+static scheduler* shards[ MAX_SHARDS ];
+static int numShards = 0;
+
+/* Where fiberYield, inlined from libfiber.h, switches from and to */
+__thread lf_yieldState lf_yieldTarget = { NULL, NULL };
+
+/* Emits the out-of-line fiberYield, from the inline definition in
+libfiber.h */
+extern inline void fiberYield();
+
+/* Builds the initial frame at the top of fiber->stack_bottom. */
+static void create_stack(fiber* fiber, int stack_size, void (*fptr)(void));
+extern void* asm_call_fiber_exit;
+
+#ifdef LF_SHARED_STACK
+/* Bytes set aside for the initial frame built by create_stack */
+#define SHARED_FRAME_SIZE 64
+#endif
+
+/* Scheduling events recorded while tracing */
+#define TRACE_SPAWN	0
+#define TRACE_SWITCH_IN	1
+#define TRACE_SWITCH_OUT	2
+#define TRACE_PARK	3
+#define TRACE_WAKE	4
+#define TRACE_EXIT	5
+
+/* Number of events kept per shard. Older events are overwritten. */
+#define TRACE_RING_SIZE (64*1024)
+
+typedef struct
+{
+	uint64_t tsc;
+	int fiber; /* Slot of the fiber in its shard */
+	int type;
+} traceEvent;
+
+/* Events of one shard. Only the shard's thread writes it, so recording an
+event is a plain store and a release of next. */
+typedef struct
+{
+	atomic_uint_fast64_t next; /* Total number of events recorded */
+	traceEvent events[ TRACE_RING_SIZE ];
+} traceRing;
+
+/* Non-zero between fiberTraceStart and fiberTraceStop */
+static atomic_int tracing = 0;
+/* Events are recorded for fibers whose spawnNumber is a multiple of this */
+static atomic_uint traceSampleEvery = 1;
+/* Allocated by each shard the first time it records an event */
+static traceRing* traceRings[ MAX_SHARDS ];
+/* TSC and wall clock when tracing started, to convert TSC to time */
+static uint64_t traceStartTsc;
+static struct timespec traceStartTime;
+
+/* Appends an event to the calling shard's trace ring if the fiber at index
+is sampled. */
+static void recordTraceEvent( int type, int index )
+{
+	traceRing* ring = traceRings[ sched->shard ];
+	uint_fast64_t next;
+	traceEvent* event;
+
+	/* Sampling whole fibers keeps each fiber's run events paired */
+	if ( sched->fiberList[index].spawnNumber %
+		atomic_load_explicit( &traceSampleEvery, memory_order_relaxed ) != 0 )
+	{
+		return;
+	}
+	if ( ring == NULL )
+	{
+		ring = (traceRing*) calloc( 1, sizeof(*ring) );
+		if ( ring == NULL ) return;
+		traceRings[ sched->shard ] = ring;
+	}
+	next = atomic_load_explicit( &ring->next, memory_order_relaxed );
+	event = &ring->events[ next % TRACE_RING_SIZE ];
+	event->tsc = __rdtsc();
+	event->fiber = index;
+	event->type = type;
+	atomic_store_explicit( &ring->next, next + 1, memory_order_release );
+}
+
+/* Records an event if tracing is on. Costs a load and a branch otherwise. */
+#define TRACE( type, index ) do { \
+	if ( atomic_load_explicit( &tracing, memory_order_relaxed ) ) recordTraceEvent( type, index ); \
+} while ( 0 )
+
+/* Releases a scheduler. Its fields may be NULL or -1 if it was never fully
+created. */
+static void freeScheduler( scheduler* s )
+{
+#ifdef LF_STACK_ARENA
+	if ( s->arena != NULL ) munmap( s->arena, s->arenaBytes );
+	free( s->arenaFree );
+#endif
+	while ( s->numPooledStacks > 0 )
+	{
+		free( s->stackPool[ -- s->numPooledStacks ] );
+	}
+#ifdef LF_SHARED_STACK
+	free( s->sharedStack );
+#endif
+	if ( s->doorbell != -1 ) close( s->doorbell );
+	if ( s->epollFd != -1 ) close( s->epollFd );
+	free( s->inbound );
+	free( s->ioWaiters );
+	free( s->tasks );
+	free( s );
+}
+
+/* Allocates a scheduler with all its fibers initially inactive. Returns NULL
+on failure. */
+static scheduler* newScheduler( int shard, int shardCount )
+{
+	int i;
+	int failed;
+	struct epoll_event doorbellEvent;
+	/* calloc so that the (possibly large) tables are faulted in lazily by
+	the thread that uses them */
+	scheduler* s = (scheduler*) calloc( 1, sizeof(*s) );
+	if ( s == NULL ) return NULL;
+
+	s->shard = shard;
+	s->currentFiber = -1;
+	s->mailWaiters.head = s->mailWaiters.tail = -1;
+	s->idleWorkers.head = s->idleWorkers.tail = -1;
+	s->mainFiber.stack = NULL;
+	s->mainFiber.stack_bottom = NULL;
+
+	/* Hand out low slots first */
+	for ( i = 0; i < MAX_FIBERS; ++ i )
+	{
+		s->freeSlots[i] = MAX_FIBERS - 1 - i;
+	}
+	s->numFree = MAX_FIBERS;
+
+	/* aligned_alloc, so the indexes of each ring really are on separate
+	cache lines */
+	s->inbound = (shardRing*) aligned_alloc( _Alignof(shardRing), shardCount * sizeof(*s->inbound) );
+	if ( s->inbound != NULL ) memset( s->inbound, 0, shardCount * sizeof(*s->inbound) );
+	s->doorbell = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+	s->epollFd = epoll_create1( EPOLL_CLOEXEC );
+	failed = s->inbound == NULL || s->doorbell == -1 || s->epollFd == -1;
+	if ( ! failed )
+	{
+		doorbellEvent.events = EPOLLIN;
+		doorbellEvent.data.u64 = DOORBELL_KEY;
+		failed = epoll_ctl( s->epollFd, EPOLL_CTL_ADD, s->doorbell, &doorbellEvent ) == -1;
+	}
+#ifdef LF_SHARED_STACK
+	s->sharedStack = malloc( FIBER_STACK );
+	s->stackOwner = -1;
+	failed = failed || s->sharedStack == NULL;
+#endif
+	if ( failed )
+	{
+		LF_DEBUG_OUT( "Error: Could not create scheduler." );
+		freeScheduler( s );
+		return NULL;
+	}
+	return s;
+}
+
+/* Sets up the calling thread as shard 0. Calling it again on that thread
+keeps the scheduler and its fibers. */
+void initFibers()
+{
+	if ( sched != NULL ) return;
+	if ( numShards != 0 )
+	{
+		/* Another thread is shard 0, or runShards is running */
+		LF_DEBUG_OUT( "Error: Fibers are already running on another thread." );
+		abort();
+	}
+	sched = newScheduler( 0, 1 );
+	if ( sched == NULL ) abort();
+	lf_yieldTarget.mainFiber = &sched->mainFiber;
+	shards[0] = sched;
+	numShards = 1;
+}
+
+static void pushRunnable( int index )
+{
+	sched->runQueue[ (sched->runHead + sched->runCount) % MAX_FIBERS ] = index;
+	++ sched->runCount;
+}
+
+static int popRunnable()
+{
+	int index = sched->runQueue[ sched->runHead ];
+	sched->runHead = (sched->runHead + 1) % MAX_FIBERS;
+	-- sched->runCount;
+	return index;
+}
+
+/* Adds the fiber at index to the back of queue. */
+static void waitQueuePush( waitQueue* queue, int index )
+{
+	fiber* f = &sched->fiberList[index];
+	assert( f->waitingOn == NULL );
+	f->waitingOn = queue;
+	f->waitNext = -1;
+	f->waitPrev = queue->tail;
+	if ( queue->tail == -1 ) queue->head = index;
+	else sched->fiberList[ queue->tail ].waitNext = index;
+	queue->tail = index;
+}
+
+/* Takes the fiber at index off the queue it is waiting on. */
+static void waitQueueRemove( int index )
+{
+	fiber* f = &sched->fiberList[index];
+	waitQueue* queue = f->waitingOn;
+	assert( queue != NULL );
+	if ( f->waitPrev == -1 ) queue->head = f->waitNext;
+	else sched->fiberList[ f->waitPrev ].waitNext = f->waitNext;
+	if ( f->waitNext == -1 ) queue->tail = f->waitPrev;
+	else sched->fiberList[ f->waitNext ].waitPrev = f->waitPrev;
+	f->waitingOn = NULL;
+}
+
+/* Removes the fiber at the front of queue and makes it runnable. Returns 0
+if the queue was empty. */
+static int wakeOne( waitQueue* queue )
+{
+	int index = queue->head;
+	if ( index == -1 ) return 0;
+	waitQueueRemove( index );
+	fiberUnpark( sched->shard * MAX_FIBERS + index );
+	return 1;
+}
+
+long long fiberNow()
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Returns the earlier of two deadlines, where 0 is no deadline. */
+static long long earlierDeadline( long long a, long long b )
+{
+	if ( a == 0 ) return b;
+	if ( b == 0 ) return a;
+	return a < b ? a : b;
+}
+
+/* Puts the fiber at heap position i, updating its timerIndex. */
+static void placeTimer( int i, int index )
+{
+	sched->timerHeap[i] = index;
+	sched->fiberList[index].timerIndex = i;
+}
+
+#define TIMER_DEADLINE( i ) ( sched->fiberList[ sched->timerHeap[i] ].timerDeadline )
+
+/* Moves the timer at heap position i up or down until the heap is ordered. */
+static void siftTimer( int i )
+{
+	int index = sched->timerHeap[i];
+	long long deadline = sched->fiberList[index].timerDeadline;
+
+	while ( i > 0 && TIMER_DEADLINE( (i - 1) / 2 ) > deadline )
+	{
+		placeTimer( i, sched->timerHeap[ (i - 1) / 2 ] );
+		i = (i - 1) / 2;
+	}
+	for ( ;; )
+	{
+		int child = 2 * i + 1;
+		if ( child >= sched->numTimers ) break;
+		if ( child + 1 < sched->numTimers && TIMER_DEADLINE( child + 1 ) < TIMER_DEADLINE( child ) )
+		{
+			++ child;
+		}
+		if ( TIMER_DEADLINE( child ) >= deadline ) break;
+		placeTimer( i, sched->timerHeap[child] );
+		i = child;
+	}
+	placeTimer( i, index );
+}
+
+static void addTimer( int index, long long deadline )
+{
+	sched->fiberList[index].timerDeadline = deadline;
+	placeTimer( sched->numTimers, index );
+	siftTimer( sched->numTimers ++ );
+}
+
+static void removeTimer( int index )
+{
+	int i = sched->fiberList[index].timerIndex;
+	int last = sched->timerHeap[ -- sched->numTimers ];
+	sched->fiberList[index].timerIndex = -1;
+	if ( last == index ) return;
+	placeTimer( i, last );
+	siftTimer( i );
+}
+
+/* Wakes the parked fibers whose deadline has passed. */
+static void expireTimers()
+{
+	long long now;
+	if ( sched->numTimers == 0 ) return;
+
+	now = fiberNow();
+	while ( sched->numTimers > 0 && TIMER_DEADLINE( 0 ) <= now )
+	{
+		int index = sched->timerHeap[0];
+		removeTimer( index );
+		sched->fiberList[index].timedOut = 1;
+		fiberUnpark( sched->shard * MAX_FIBERS + index );
+	}
+}
+
+/* Parks the calling fiber until it is unparked or deadline (0 for none)
+passes. Returns LF_TIMEOUT in the second case. */
+static int parkUntil( long long deadline )
+{
+	fiber* self;
+	assert( sched->inFiber );
+	self = &sched->fiberList[sched->currentFiber];
+
+	/* Consume a wakeup that arrived while we were running */
+	if ( self->wakePending )
+	{
+		self->wakePending = 0;
+		return LF_NOERROR;
+	}
+	if ( deadline != 0 )
+	{
+		if ( deadline <= fiberNow() ) return LF_TIMEOUT;
+		addTimer( sched->currentFiber, deadline );
+	}
+
+	LF_DEBUG_OUT1( "Fiber %d parking.", sched->currentFiber );
+	self->timedOut = 0;
+	self->state = FIBER_PARKED;
+	lf_asm_switch( &sched->mainFiber, self, 0 );
+
+	/* Whatever woke the fiber took it out of the timer heap. This return
+	answers every wakeup since it parked, so none is left pending. */
+	assert( self->timerIndex == -1 );
+	self->wakePending = 0;
+	if ( self->timedOut )
+	{
+		self->timedOut = 0;
+		return LF_TIMEOUT;
+	}
+	return LF_NOERROR;
+}
+
+/* Parks the calling fiber on queue until wakeOne picks it or deadline (0
+for none) passes. Like fiberPark, it can return spuriously; the fiber is off
+the queue either way. */
+static int waitOn( waitQueue* queue, long long deadline )
+{
+	int result;
+	waitQueuePush( queue, sched->currentFiber );
+	result = parkUntil( deadline );
+	if ( sched->fiberList[ sched->currentFiber ].waitingOn != NULL )
+	{
+		waitQueueRemove( sched->currentFiber );
+	}
+	return result;
+}
+
+/* Takes every wakeup posted by other threads and makes those fibers
+runnable. Must be called on the scheduler's thread. */
+static void drainWakeups()
+{
+	fiber* batch;
+	fiber* ordered = NULL;
+
+	if ( atomic_load_explicit( &sched->wakeupInbox, memory_order_relaxed ) == NULL ) return;
+	batch = atomic_exchange_explicit( &sched->wakeupInbox, NULL, memory_order_acquire );
+
+	/* The inbox is LIFO: reverse it so fibers run in the order they were woken */
+	while ( batch != NULL )
+	{
+		fiber* next = batch->nextWakeup;
+		batch->nextWakeup = ordered;
+		ordered = batch;
+		batch = next;
+	}
+
+	while ( ordered != NULL )
+	{
+		fiber* next = ordered->nextWakeup;
+		int index = (int) (ordered - sched->fiberList);
+		/* After this store another thread may queue the fiber again */
+		atomic_store_explicit( &ordered->wakeQueued, 0, memory_order_release );
+		fiberUnpark( sched->shard * MAX_FIBERS + index );
+		ordered = next;
+	}
+}
+
+/* Wakes every fiber waiting in fiberShardReceive if another shard has sent
+a message since the last check. */
+static void drainMail()
+{
+	if ( sched->mailWaiters.head == -1 ) return;
+	if ( ! atomic_load_explicit( &sched->mailPending, memory_order_relaxed ) ) return;
+	atomic_store( &sched->mailPending, 0 );
+
+	while ( wakeOne( &sched->mailWaiters ) ) {}
+}
+
+/* Makes the table of descriptor waiters big enough for fd. */
+static int growIoWaiters( int fd )
+{
+	int size = sched->ioWaitersSize == 0 ? 64 : sched->ioWaitersSize;
+	ioWaiters* table;
+	int i;
+
+	while ( size <= fd ) size *= 2;
+	table = (ioWaiters*) realloc( sched->ioWaiters, size * sizeof(*table) );
+	if ( table == NULL )
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	for ( i = sched->ioWaitersSize; i < size; ++ i )
+	{
+		table[i].reader = -1;
+		table[i].writer = -1;
+	}
+	sched->ioWaiters = table;
+	sched->ioWaitersSize = size;
+	return 0;
+}
+
+/* Arms fd's one-shot registration for the events its waiters want, or
+removes it if none is left. */
+static int armDescriptor( int fd )
+{
+	struct epoll_event event;
+	const ioWaiters* waiters = &sched->ioWaiters[fd];
+
+	event.events = 0;
+	if ( waiters->reader != -1 ) event.events |= EPOLLIN;
+	if ( waiters->writer != -1 ) event.events |= EPOLLOUT;
+	event.data.u64 = (uint64_t) fd;
+	if ( event.events == 0 ) return epoll_ctl( sched->epollFd, EPOLL_CTL_DEL, fd, &event );
+
+	event.events |= EPOLLONESHOT;
+	/* Descriptors are usually waited on many times: try rearming first */
+	if ( epoll_ctl( sched->epollFd, EPOLL_CTL_MOD, fd, &event ) == -1 )
+	{
+		if ( errno != ENOENT || epoll_ctl( sched->epollFd, EPOLL_CTL_ADD, fd, &event ) == -1 )
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Waits up to timeout milliseconds (-1 for ever, 0 to only check) for
+descriptors that fibers are waiting on, and makes those fibers runnable.
+Also returns when the doorbell rings. */
+static void pollIo( int timeout )
+{
+	struct epoll_event events[ MAX_IO_EVENTS ];
+	uint64_t count;
+	int i;
+	/* Errors (EINTR) are harmless: the caller checks again */
+	int ready = epoll_wait( sched->epollFd, events, MAX_IO_EVENTS, timeout );
+
+	for ( i = 0; i < ready; ++ i )
+	{
+		if ( events[i].data.u64 == DOORBELL_KEY )
+		{
+			/* Reset it. It is non-blocking, so a lost race is harmless. */
+			if ( read( sched->doorbell, &count, sizeof(count) ) != sizeof(count) )
+			{
+				LF_DEBUG_OUT( "Doorbell was already reset." );
+			}
+		}
+		else
+		{
+			int fd = (int) events[i].data.u64;
+			ioWaiters* waiters = &sched->ioWaiters[fd];
+			/* Errors and hangups end the waits in both directions */
+			if ( waiters->reader != -1 && ( events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) ) )
+			{
+				fiberUnpark( sched->shard * MAX_FIBERS + waiters->reader );
+				waiters->reader = -1;
+			}
+			if ( waiters->writer != -1 && ( events[i].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) ) )
+			{
+				fiberUnpark( sched->shard * MAX_FIBERS + waiters->writer );
+				waiters->writer = -1;
+			}
+			/* Firing disarmed the registration for the waiter left, if any */
+			if ( waiters->reader != -1 || waiters->writer != -1 ) armDescriptor( fd );
+		}
+	}
+	sched->pollCountdown = sched->runCount + 1;
+}
+
+/* Blocks the scheduler until a descriptor is ready, a deadline passes, or
+another thread posts a wakeup or a message. */
+static void waitForWakeups()
+{
+	int timeout = -1;
+	if ( sched->numTimers > 0 )
+	{
+		/* Round up, so the deadline has passed when epoll returns */
+		long long wait = ( TIMER_DEADLINE( 0 ) - fiberNow() + 999999 ) / 1000000;
+		timeout = wait < 0 ? 0 : wait > INT_MAX ? INT_MAX : (int) wait;
+	}
+
+	LF_DEBUG_OUT( "No runnable fibers. Waiting for a wakeup." );
+	atomic_store( &sched->sleeping, 1 );
+	/* Check again: anything posted before the store above did not ring */
+	if ( atomic_load( &sched->wakeupInbox ) == NULL &&
+		! ( sched->mailWaiters.head != -1 && atomic_load( &sched->mailPending ) ) )
+	{
+		pollIo( timeout );
+	}
+	atomic_store( &sched->sleeping, 0 );
+}
+
+/* Interrupts the idle wait of target if it is asleep. Called by other
+threads after they have published work for it. */
+static void ringDoorbell( scheduler* target )
+{
+	static const uint64_t one = 1;
+
+	/* Only pay for the syscall if the scheduler is actually asleep */
+	if ( atomic_load( &target->sleeping ) )
+	{
+		if ( write( target->doorbell, &one, sizeof(one) ) != sizeof(one) )
+		{
+			LF_DEBUG_OUT( "Error: doorbell write failed." );
+		}
+	}
+}
+
+#ifdef LF_STACK_ARENA
+/* Reserves the arena. Explicit huge pages (MAP_HUGETLB) are used if enough
+are configured; otherwise the region is aligned to a huge page and
+transparent huge pages are requested with MADV_HUGEPAGE. */
+static void reserveArena()
+{
+	size_t bytes = ( (size_t) ARENA_SLOTS * ARENA_SLOT + HUGE_PAGE_SIZE - 1 ) /
+		HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	char* region;
+
+	sched->arenaReserved = 1;
+	sched->arenaFree = (int*) malloc( ARENA_SLOTS * sizeof(int) );
+	if ( sched->arenaFree == NULL ) return;
+
+	region = (char*) mmap( NULL, bytes, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+	if ( region == MAP_FAILED )
+	{
+		char* aligned;
+		size_t head;
+
+		/* Over-reserve so the region can be trimmed to a huge page boundary */
+		region = (char*) mmap( NULL, bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+		if ( region == MAP_FAILED )
+		{
+			LF_DEBUG_OUT( "Error: Could not reserve the stack arena." );
+			return;
+		}
+		aligned = (char*) ( ( (uintptr_t) region + HUGE_PAGE_SIZE - 1 ) &
+			~ (uintptr_t) ( HUGE_PAGE_SIZE - 1 ) );
+		head = aligned - region;
+		if ( head > 0 ) munmap( region, head );
+		munmap( aligned + bytes, HUGE_PAGE_SIZE - head );
+		region = aligned;
+
+		if ( madvise( region, bytes, MADV_HUGEPAGE ) )
+		{
+			LF_DEBUG_OUT( "Transparent huge pages are not available for the stack arena." );
+		}
+	}
+	sched->arena = region;
+	sched->arenaBytes = bytes;
+}
+
+/* Returns an unused arena stack with fresh canaries below it, or NULL if
+the arena is full or could not be reserved. */
+static void* acquireArenaStack()
+{
+	int slot;
+	char* stack;
+	uintptr_t* canary;
+	int i;
+
+	if ( ! sched->arenaReserved ) reserveArena();
+	if ( sched->arena == NULL ) return NULL;
+
+	if ( sched->numArenaFree > 0 ) slot = sched->arenaFree[ -- sched->numArenaFree ];
+	else if ( sched->arenaUsed < ARENA_SLOTS ) slot = sched->arenaUsed ++;
+	else return NULL;
+
+	stack = sched->arena + (size_t) slot * ARENA_SLOT + ARENA_GUARD;
+	canary = (uintptr_t*) stack;
+	for ( i = 1; i <= ARENA_CANARY_WORDS; ++ i ) canary[-i] = ARENA_CANARY;
+	return stack;
+}
+
+/* Returns stack to the arena if it came from there. Aborts if the fiber
+overflowed into the guard gap, since the stack below is then corrupt. */
+static int releaseArenaStack( void* stack )
+{
+	uintptr_t* canary = (uintptr_t*) stack;
+	int i;
+
+	if ( sched->arena == NULL || (char*) stack < sched->arena ||
+		(char*) stack >= sched->arena + sched->arenaBytes )
+	{
+		return 0;
+	}
+	for ( i = 1; i <= ARENA_CANARY_WORDS; ++ i )
+	{
+		if ( canary[-i] != ARENA_CANARY )
+		{
+			LF_DEBUG_OUT( "Error: A fiber overflowed its stack in the stack arena." );
+			abort();
+		}
+	}
+	sched->arenaFree[ sched->numArenaFree ++ ] =
+		(int) ( ( (char*) stack - ARENA_GUARD - sched->arena ) / ARENA_SLOT );
+	return 1;
+}
+#endif
+
+#ifndef LF_SHARED_STACK
+/* Returns a STACK_SIZE byte stack, reusing one from the pool if possible. */
+static void* acquireStack()
+{
+#ifdef LF_STACK_ARENA
+	void* stack = acquireArenaStack();
+	if ( stack != NULL ) return stack;
+#endif
+	if ( sched->numPooledStacks > 0 )
+	{
+		return sched->stackPool[ -- sched->numPooledStacks ];
+	}
+	return malloc( STACK_SIZE );
+}
+
+/* Returns a stack to the pool, or frees it if the pool is full. */
+static void releaseStack( void* stack )
+{
+#ifdef LF_STACK_ARENA
+	if ( releaseArenaStack( stack ) ) return;
+#endif
+	if ( sched->numPooledStacks < STACK_POOL_SIZE )
+	{
+		sched->stackPool[ sched->numPooledStacks ++ ] = stack;
+	}
+	else
+	{
+		free( stack );
+	}
+}
+#endif
+
+/* The first function run by every fiber: calls the recorded entry point.
+When it returns, the fiber returns to asm_call_fiber_exit. */
+static void fiber_start()
+{
+	fiber* self = &sched->fiberList[ sched->currentFiber ];
+	if ( self->function != NULL )
+	{
+		self->function();
+	}
+	else
+	{
+		self->functionWithArg( self->arg );
+	}
+}
+
+/* Gives a fiber that has never run its stack and initial frame. Spawning
+only records the entry point, so fibers that wait a long time to run do
+not hold a stack meanwhile. Returns 0 if memory could not be allocated. */
+static int materializeFiber( fiber* f )
+{
+#ifdef LF_SHARED_STACK
+	/* Build the initial frame in a small private buffer, then point the
+	stack at the place it will be copied to on the shared stack. */
+	f->stack_bottom = malloc( SHARED_FRAME_SIZE );
+	if ( f->stack_bottom == NULL ) return 0;
+	create_stack( f, SHARED_FRAME_SIZE, &fiber_start );
+	f->savedCapacity = SHARED_FRAME_SIZE;
+	f->stack = (void**) ( (char*) sched->sharedStack + FIBER_STACK - SHARED_FRAME_SIZE +
+		( (char*) f->stack - (char*) f->stack_bottom ) );
+#else
+	f->stack_bottom = acquireStack();
+	if ( f->stack_bottom == NULL ) return 0;
+	create_stack( f, STACK_SIZE, &fiber_start );
+#endif
+	return 1;
+}
+
+#ifdef LF_SHARED_STACK
+/* Copies the frames of a fiber that has switched out of the shared stack
+into its private buffer, resizing the buffer to fit. */
+static void saveSharedStack( fiber* f )
+{
+	char* top = (char*) sched->sharedStack + FIBER_STACK;
+	size_t used = top - (char*) f->stack;
+
+	if ( used > f->savedCapacity || used < f->savedCapacity / 2 )
+	{
+		void* buffer = realloc( f->stack_bottom, used );
+		if ( buffer == NULL )
+		{
+			LF_DEBUG_OUT( "Error: Could not allocate a stack copy." );
+			abort();
+		}
+		f->stack_bottom = buffer;
+		f->savedCapacity = used;
+	}
+	memcpy( f->stack_bottom, f->stack, used );
+}
+
+/* Puts the frames of the fiber at index back on the shared stack, saving
+those of the fiber that ran there last. Called on the main stack. */
+static void restoreSharedStack( int index )
+{
+	fiber* f = &sched->fiberList[index];
+	char* top = (char*) sched->sharedStack + FIBER_STACK;
+
+	/* Nothing else has run since this fiber switched out */
+	if ( sched->stackOwner == index ) return;
+
+	if ( sched->stackOwner != -1 )
+	{
+		saveSharedStack( &sched->fiberList[ sched->stackOwner ] );
+	}
+	memcpy( f->stack, f->stack_bottom, top - (char*) f->stack );
+	sched->stackOwner = index;
+}
+#endif
+
+/* Releases the stack and slot of the fiber at index, which exited or
+never started. */
+static void freeFiber( int index )
+{
+	fiber* f = &sched->fiberList[index];
+#ifdef LF_SHARED_STACK
+	free( f->stack_bottom );
+	if ( sched->stackOwner == index ) sched->stackOwner = -1;
+#else
+	if ( f->stack_bottom != NULL ) releaseStack( f->stack_bottom );
+#endif
+	f->stack_bottom = NULL;
+	f->stack = NULL;
+	f->state = FIBER_FREE;
+
+	-- sched->numFibers;
+	-- sched->tagFibers[ f->tag ];
+	sched->freeSlots[ sched->numFree ++ ] = index;
+}
+
+/* Runs the next runnable fiber until it yields, parks or exits. This is the
+side of fiberYield that runs in main; in a fiber, fiberYield only switches
+to main, inline. */
+void lf_dispatch()
+{
+	fiber* current;
+	uint64_t switchTsc = 0;
+	assert( ! sched->inFiber );
+
+	drainWakeups();
+	drainMail();
+	expireTimers();
+	/* Check for I/O about once per pass over the run queue, so fibers
+	waiting on descriptors are not starved by fibers that yield */
+	if ( sched->numIoWaiters > 0 && sched->runCount > 0 && -- sched->pollCountdown <= 0 )
+	{
+		pollIo( 0 );
+	}
+	while ( sched->runCount == 0 )
+	{
+		/* Every remaining fiber is parked: sleep until one is woken */
+		if ( sched->numFibers == 0 ) return;
+		waitForWakeups();
+		drainWakeups();
+		drainMail();
+		expireTimers();
+	}
+
+	/* Saved the state so call the next fiber */
+	sched->currentFiber = popRunnable();
+	current = &sched->fiberList[ sched->currentFiber ];
+	if ( current->stack == NULL && ! materializeFiber( current ) )
+	{
+		/* Drop it rather than retry: if nothing releases memory, retrying
+		would spin for ever */
+		LF_DEBUG_OUT1( "Error: Could not allocate a stack for fiber %d.", sched->currentFiber );
+		TRACE( TRACE_EXIT, sched->currentFiber );
+		freeFiber( sched->currentFiber );
+		sched->startFailed = 1;
+		return;
+	}
+	
+	LF_DEBUG_OUT1( "Switching to fiber %d.", sched->currentFiber );
+#ifdef LF_SHARED_STACK
+	restoreSharedStack( sched->currentFiber );
+#endif
+	TRACE( TRACE_SWITCH_IN, sched->currentFiber );
+	sched->inFiber = 1;
+	lf_yieldTarget.currentFiber = current;
+	if ( sched->accounting ) switchTsc = __rdtsc();
+	lf_asm_switch( current, &sched->mainFiber, 0 );
+	if ( sched->accounting ) sched->tagTicks[ current->tag ] += __rdtsc() - switchTsc;
+	lf_yieldTarget.currentFiber = NULL;
+	sched->inFiber = 0;
+	LF_DEBUG_OUT1( "Fiber %d switched to main context.", sched->currentFiber );
+	TRACE( TRACE_SWITCH_OUT, sched->currentFiber );
+	
+	if ( current->state == FIBER_EXITED )
+	{
+		TRACE( TRACE_EXIT, sched->currentFiber );
+		LF_DEBUG_OUT1( "Fiber %d is finished. Cleaning up.\n", sched->currentFiber );
+		freeFiber( sched->currentFiber );
+	}
+	else if ( current->state == FIBER_RUNNABLE )
+	{
+		pushRunnable( sched->currentFiber );
+	}
+	else
+	{
+		/* It parked: fiberUnpark puts it back in the run queue */
+		TRACE( TRACE_PARK, sched->currentFiber );
+	}
+}
+
+/* Records the entry point of a new fiber and makes it runnable. A tag of -1
+means the spawner's tag. */
+static int spawnEntry( void (*func)(void), void (*funcWithArg)(void*), void* arg, int tag )
+{
+	int index;
+	fiber* f;
+	if ( sched->numFree == 0 ) return LF_MAXFIBERS;
+	index = sched->freeSlots[ -- sched->numFree ];
+	f = &sched->fiberList[index];
+
+	f->function = func;
+	f->functionWithArg = funcWithArg;
+	f->arg = arg;
+	f->state = FIBER_RUNNABLE;
+	f->wakePending = 0;
+	f->waitingOn = NULL;
+	f->timerIndex = -1;
+	f->timedOut = 0;
+	/* Nested work is bounded by the spawner's deadline */
+	f->deadline = sched->inFiber ? sched->fiberList[ sched->currentFiber ].deadline : 0;
+	if ( tag == -1 ) tag = sched->inFiber ? sched->fiberList[ sched->currentFiber ].tag : 0;
+	f->tag = tag;
+	f->spawnNumber = sched->numSpawned ++;
+	++ sched->tagFibers[tag];
+	pushRunnable( index );
+	TRACE( TRACE_SPAWN, index );
+	++ sched->numFibers;
+	
+	return LF_NOERROR;
+}
+
+int spawnFiber( void (*func)(void) )
+{
+	assert( func != NULL );
+	return spawnEntry( func, NULL, NULL, -1 );
+}
+
+int spawnFiberWithArg( void (*func)(void*), void* arg )
+{
+	assert( func != NULL );
+	return spawnEntry( NULL, func, arg, -1 );
+}
+
+int spawnFiberTagged( void (*func)(void*), void* arg, int tag )
+{
+	assert( func != NULL );
+	assert( 0 <= tag && tag < MAX_TAGS );
+	if ( ! sched->accounting )
+	{
+		sched->accounting = 1;
+		sched->accountingStartTsc = __rdtsc();
+		sched->accountingStartTime = fiberNow();
+	}
+	return spawnEntry( NULL, func, arg, tag );
+}
+
+/* Returns the bytes of the fiber's stack that are resident in memory. With
+LF_SHARED_STACK, the size of the copy of its frames instead. */
+static long long residentStackBytes( fiber* f )
+{
+#ifdef LF_SHARED_STACK
+	return f->stack == NULL ? 0 : (long long) f->savedCapacity;
+#else
+	/* Enough for 4 KB pages, the smallest there are */
+	unsigned char resident[ STACK_SIZE / 4096 + 2 ];
+	long pageSize = sysconf( _SC_PAGESIZE );
+	uintptr_t start;
+	uintptr_t end;
+	size_t pages;
+	size_t i;
+	long long bytes = 0;
+
+	if ( f->stack_bottom == NULL ) return 0;
+	start = (uintptr_t) f->stack_bottom & ~( (uintptr_t) pageSize - 1 );
+	end = (uintptr_t) f->stack_bottom + STACK_SIZE;
+	pages = ( end - start + pageSize - 1 ) / pageSize;
+	if ( mincore( (void*) start, end - start, resident ) == -1 ) return 0;
+
+	for ( i = 0; i < pages; ++ i )
+	{
+		if ( resident[i] & 1 ) bytes += pageSize;
+	}
+	return bytes;
+#endif
+}
+
+int fiberGetTagUsage( int tag, fiberTagUsage* usage )
+{
+	int i;
+	uint64_t ticks;
+	long long nanoseconds;
+	assert( 0 <= tag && tag < MAX_TAGS );
+
+	usage->fibers = sched->tagFibers[tag];
+	usage->cpuNanoseconds = 0;
+	usage->stackBytes = 0;
+
+	/* Calibrate the TSC against the time since accounting started */
+	ticks = __rdtsc() - sched->accountingStartTsc;
+	nanoseconds = fiberNow() - sched->accountingStartTime;
+	if ( sched->accounting && ticks > 0 && nanoseconds > 0 )
+	{
+		usage->cpuNanoseconds = (long long) ( (double) sched->tagTicks[tag] * nanoseconds / ticks );
+	}
+
+	for ( i = 0; i < MAX_FIBERS; ++ i )
+	{
+		fiber* f = &sched->fiberList[i];
+		if ( f->state != FIBER_FREE && f->tag == tag ) usage->stackBytes += residentStackBytes( f );
+	}
+	return LF_NOERROR;
+}
+
+int waitForAllFibers()
+{
+	int fibersRemaining = 0;
+	
+	/* If we are in a fiber, wait for all the *other* fibers to quit */
+	if ( sched->inFiber ) fibersRemaining = 1;
+	
+	LF_DEBUG_OUT1( "Waiting until there are only %d threads remaining...", fibersRemaining );
+	
+	/* Execute the fibers until they quit */
+	while ( sched->numFibers > fibersRemaining )
+	{
+		fiberYield();
+	}
+	
+	if ( sched->startFailed )
+	{
+		sched->startFailed = 0;
+		return LF_MALLOCERROR;
+	}
+	return LF_NOERROR;
+}
+
+int fiberSelf()
+{
+	if ( ! sched->inFiber ) return -1;
+	return sched->shard * MAX_FIBERS + sched->currentFiber;
+}
+
+void fiberPark()
+{
+	parkUntil( 0 );
+}
+
+int fiberParkUntil( long long deadline )
+{
+	return parkUntil( earlierDeadline( deadline, fiberDeadline() ) );
+}
+
+long long fiberDeadline()
+{
+	assert( sched->inFiber );
+	return sched->fiberList[ sched->currentFiber ].deadline;
+}
+
+void fiberSetDeadline( long long deadline )
+{
+	assert( sched->inFiber );
+	sched->fiberList[ sched->currentFiber ].deadline = deadline;
+}
+
+void fiberUnpark( int id )
+{
+	int index = id % MAX_FIBERS;
+	fiber* target;
+	/* Fibers on other shards must be woken with fiberWakeup */
+	assert( id / MAX_FIBERS == sched->shard );
+	target = &sched->fiberList[index];
+
+	if ( target->state == FIBER_PARKED )
+	{
+		LF_DEBUG_OUT1( "Unparking fiber %d.", index );
+		/* Its deadline no longer matters */
+		if ( target->timerIndex != -1 ) removeTimer( index );
+		target->state = FIBER_RUNNABLE;
+		pushRunnable( index );
+		TRACE( TRACE_WAKE, index );
+	}
+	else if ( target->timedOut )
+	{
+		/* Its deadline expired, but it is woken before it ran: report the
+		wakeup rather than the timeout */
+		target->timedOut = 0;
+	}
+	else if ( target->state == FIBER_RUNNABLE )
+	{
+		target->wakePending = 1;
+	}
+}
+
+void fiberWakeup( int id )
+{
+	scheduler* owner;
+	fiber* target;
+	fiber* head;
+	assert( 0 <= id && id / MAX_FIBERS < numShards );
+	owner = shards[ id / MAX_FIBERS ];
+	target = &owner->fiberList[ id % MAX_FIBERS ];
+
+	/* Already in the inbox: the pending wakeup covers this one too */
+	if ( atomic_exchange( &target->wakeQueued, 1 ) ) return;
+
+	head = atomic_load_explicit( &owner->wakeupInbox, memory_order_relaxed );
+	do
+	{
+		target->nextWakeup = head;
+	} while ( ! atomic_compare_exchange_weak_explicit( &owner->wakeupInbox, &head, target,
+		memory_order_seq_cst, memory_order_relaxed ) );
+
+	ringDoorbell( owner );
+}
+
+int fiberShard()
+{
+	return sched->shard;
+}
+
+int fiberShardCount()
+{
+	return numShards;
+}
+
+int fiberShardSend( int shard, void* message )
+{
+	shardRing* ring;
+	unsigned int tail;
+	assert( 0 <= shard && shard < numShards );
+	assert( message != NULL );
+	ring = &shards[shard]->inbound[ sched->shard ];
+
+	/* Only this thread writes tail, so a relaxed load is enough */
+	tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+	if ( tail - atomic_load_explicit( &ring->head, memory_order_acquire ) == SHARD_RING_SIZE )
+	{
+		return LF_QUEUEFULL;
+	}
+	ring->messages[ tail % SHARD_RING_SIZE ] = message;
+	atomic_store_explicit( &ring->tail, tail + 1, memory_order_release );
+
+	atomic_store( &shards[shard]->mailPending, 1 );
+	ringDoorbell( shards[shard] );
+	return LF_NOERROR;
+}
+
+/* Removes the next message sent to this shard, or returns NULL. */
+static void* takeMessage()
+{
+	int i;
+	for ( i = 0; i < numShards; ++ i )
+	{
+		shardRing* ring = &sched->inbound[i];
+		unsigned int head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+		if ( head != atomic_load_explicit( &ring->tail, memory_order_acquire ) )
+		{
+			void* message = ring->messages[ head % SHARD_RING_SIZE ];
+			atomic_store_explicit( &ring->head, head + 1, memory_order_release );
+			return message;
+		}
+	}
+	return NULL;
+}
+
+void* fiberShardReceive()
+{
+	void* message;
+	assert( sched->inFiber );
+
+	while ( (message = takeMessage()) == NULL )
+	{
+		waitOn( &sched->mailWaiters, 0 );
+	}
+	return message;
+}
+
+void* fiberShardReceiveUntil( long long deadline )
+{
+	void* message;
+	assert( sched->inFiber );
+	deadline = earlierDeadline( deadline, fiberDeadline() );
+
+	while ( (message = takeMessage()) == NULL )
+	{
+		if ( waitOn( &sched->mailWaiters, deadline ) == LF_TIMEOUT ) return takeMessage();
+	}
+	return message;
+}
+
+/* The loop run by each executor worker fiber. */
+static void executorWorker()
+{
+	for ( ;; )
+	{
+		while ( sched->numTasks > 0 )
+		{
+			task next = sched->tasks[ sched->taskHead ];
+			sched->taskHead = (sched->taskHead + 1) % sched->taskCapacity;
+			-- sched->numTasks;
+			fiberSetDeadline( next.deadline );
+			next.function( next.arg );
+			fiberSetDeadline( 0 );
+
+			/* Do not starve other fibers while the queue is long */
+			if ( sched->runCount > 0 ) fiberYield();
+		}
+		if ( sched->stopWorkers ) return;
+		waitOn( &sched->idleWorkers, 0 );
+	}
+}
+
+int fiberExecutorStart( int workers )
+{
+	int i;
+	sched->stopWorkers = 0;
+	for ( i = 0; i < workers; ++ i )
+	{
+		int error = spawnFiber( &executorWorker );
+		if ( error != LF_NOERROR ) return error;
+	}
+	return LF_NOERROR;
+}
+
+int fiberExecutorSubmit( void (*func)(void*), void* arg )
+{
+	task* slot;
+	assert( func != NULL );
 
-#include <assert.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
+	if ( sched->numTasks == sched->taskCapacity )
+	{
+		/* Double the ring, moving the wrapped part after the rest */
+		int capacity = sched->taskCapacity == 0 ? 64 : 2 * sched->taskCapacity;
+		task* tasks = (task*) realloc( sched->tasks, capacity * sizeof(*tasks) );
+		if ( tasks == NULL ) return LF_MALLOCERROR;
+		memcpy( tasks + sched->taskCapacity, tasks, sched->taskHead * sizeof(*tasks) );
+		sched->tasks = tasks;
+		sched->taskCapacity = capacity;
+	}
 
-/* The Fiber Structure
-*  Contains the information about individual fibers.
-*/
-typedef struct
+	slot = &sched->tasks[ (sched->taskHead + sched->numTasks) % sched->taskCapacity ];
+	slot->function = func;
+	slot->arg = arg;
+	slot->deadline = sched->inFiber ? fiberDeadline() : 0;
+	++ sched->numTasks;
+
+	wakeOne( &sched->idleWorkers );
+	return LF_NOERROR;
+}
+
+void fiberExecutorStop()
 {
-	void** stack; /* The stack pointer */
-	void* stack_bottom; /* The original returned from malloc. */
-	int active;
-} fiber;
+	sched->stopWorkers = 1;
+	while ( wakeOne( &sched->idleWorkers ) ) {}
+}
 
-/* The fiber "queue" */
-static fiber fiberList[ MAX_FIBERS ];
+/* Parks the calling fiber until fd is readable (EPOLLIN) or writable
+(EPOLLOUT), or has an error or hangup. One fiber may wait for each, and a
+second one fails with EBUSY. The registration is one-shot, so it is rearmed
+on every wait and stays quiet in between. The wakeup can be spurious. Fails
+with ETIMEDOUT once the fiber's deadline has passed. */
+static int waitForDescriptor( int fd, unsigned int events )
+{
+	int reading = ( events & EPOLLIN ) != 0;
+	int* slot;
+	int result;
+	assert( sched->inFiber );
 
-/* The index of the currently executing fiber */
-static int currentFiber = -1;
-/* A boolean flag indicating if we are in the main process or if we are in a fiber */
-static int inFiber = 0;
-/* The number of active fibers */
-static int numFibers = 0;
+	if ( fd >= sched->ioWaitersSize && growIoWaiters( fd ) == -1 ) return -1;
+	slot = reading ? &sched->ioWaiters[fd].reader : &sched->ioWaiters[fd].writer;
+	if ( *slot != -1 )
+	{
+		errno = EBUSY;
+		return -1;
+	}
+	*slot = sched->currentFiber;
+	if ( armDescriptor( fd ) == -1 )
+	{
+		*slot = -1;
+		return -1;
+	}
 
-/* Stores the "main" fiber. */
-static fiber mainFiber;
+	++ sched->numIoWaiters;
+	result = parkUntil( fiberDeadline() );
+	-- sched->numIoWaiters;
 
-/* Prototype for the assembly function to switch processes. */
-extern int asm_switch(fiber* next, fiber* current, int return_value);
-static void create_stack(fiber* fiber, int stack_size, void (*fptr)(void));
-extern void* asm_call_fiber_exit;
+	/* If something else woke the fiber, or the deadline passed, the
+	registration is still armed for it: do not leave that behind. Other
+	fibers may have grown the table meanwhile. */
+	slot = reading ? &sched->ioWaiters[fd].reader : &sched->ioWaiters[fd].writer;
+	if ( *slot == sched->currentFiber )
+	{
+		*slot = -1;
+		armDescriptor( fd );
+	}
+	if ( result == LF_TIMEOUT )
+	{
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
+}
 
-/* Sets all the fibers to be initially inactive */
-void initFibers()
+ssize_t fiberRead( int fd, void* buf, size_t count )
+{
+	for ( ;; )
+	{
+		ssize_t bytes = read( fd, buf, count );
+		if ( bytes >= 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) ) return bytes;
+		if ( waitForDescriptor( fd, EPOLLIN ) == -1 ) return -1;
+	}
+}
+
+ssize_t fiberWrite( int fd, const void* buf, size_t count )
+{
+	for ( ;; )
+	{
+		ssize_t bytes = write( fd, buf, count );
+		if ( bytes >= 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) ) return bytes;
+		if ( waitForDescriptor( fd, EPOLLOUT ) == -1 ) return -1;
+	}
+}
+
+int fiberAccept( int fd, struct sockaddr* addr, socklen_t* addrlen )
 {
-	memset(fiberList, 0, sizeof(fiberList));
-	mainFiber.stack = NULL;
-	mainFiber.stack_bottom = NULL;
+	for ( ;; )
+	{
+		int connection = accept4( fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC );
+		if ( connection >= 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) ) return connection;
+		if ( waitForDescriptor( fd, EPOLLIN ) == -1 ) return -1;
+	}
 }
 
-/* Switches from a fiber to main or from main to a fiber */
-void fiberYield()
+int fiberConnect( int fd, const struct sockaddr* addr, socklen_t addrlen )
 {
-	/* If we are in a fiber, switch to the main process */
-	if ( inFiber )
+	if ( connect( fd, addr, addrlen ) == 0 ) return 0;
+	if ( errno != EINPROGRESS ) return -1;
+
+	for ( ;; )
 	{
-		/* Switch to the main context */
-		LF_DEBUG_OUT1( "libfiber debug: Fiber %d yielding the processor...", currentFiber );
+		int error;
+		socklen_t length = sizeof(error);
+		struct sockaddr_storage peer;
+		socklen_t peerLength = sizeof(peer);
 
-		asm_switch( &mainFiber, &fiberList[currentFiber], 0 );
+		if ( waitForDescriptor( fd, EPOLLOUT ) == -1 ) return -1;
+		if ( getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &length ) == -1 ) return -1;
+		if ( error != 0 )
+		{
+			errno = error;
+			return -1;
+		}
+		/* After a spurious wakeup the connection is still in progress */
+		if ( getpeername( fd, (struct sockaddr*) &peer, &peerLength ) == 0 ) return 0;
 	}
-	/* Else, we are in the main process and we need to dispatch a new fiber */
-	else
+}
+
+/* Returns the fiber with an id, which may be on another shard. */
+static fiber* fiberById( int id )
+{
+	return &shards[ id / MAX_FIBERS ]->fiberList[ id % MAX_FIBERS ];
+}
+
+/* Spin locks guarding waiter lists, which are only held for a few
+instructions */
+static void lockGuard( atomic_flag* guard )
+{
+	while ( atomic_flag_test_and_set_explicit( guard, memory_order_acquire ) )
 	{
-		if ( numFibers == 0 ) return;
-	
-		/* Saved the state so call the next fiber */
-		currentFiber = (currentFiber + 1) % numFibers;
-		
-		LF_DEBUG_OUT1( "Switching to fiber %d.", currentFiber );
-		inFiber = 1;
-		asm_switch( &fiberList[ currentFiber ], &mainFiber, 0 );
-		inFiber = 0;
-		LF_DEBUG_OUT1( "Fiber %d switched to main context.", currentFiber );
-		
-		if ( fiberList[currentFiber].active == 0 )
-		{
-			LF_DEBUG_OUT1( "Fiber %d is finished. Cleaning up.\n", currentFiber );
-			/* Free the "current" fiber's stack */
-			free( fiberList[currentFiber].stack_bottom );
-			
-			/* Swap the last fiber with the current, now empty, entry */
-			-- numFibers;
-			if ( currentFiber != numFibers )
+		_mm_pause();
+	}
+}
+
+static void unlockGuard( atomic_flag* guard )
+{
+	atomic_flag_clear_explicit( guard, memory_order_release );
+}
+
+/* Adds the calling fiber to the back of a waiter list. Needs the guard. */
+static void queueLockWaiter( int* head, int* tail )
+{
+	int id = fiberSelf();
+	fiber* self = fiberById( id );
+	self->lockNext = -1;
+	self->lockPrev = *tail;
+	if ( *tail == -1 ) *head = id;
+	else fiberById( *tail )->lockNext = id;
+	*tail = id;
+	atomic_store_explicit( &self->lockQueued, 1, memory_order_relaxed );
+}
+
+/* Takes a fiber off a waiter list. Needs the guard. */
+static void unqueueLockWaiter( int* head, int* tail, int id )
+{
+	fiber* f = fiberById( id );
+	if ( f->lockPrev == -1 ) *head = f->lockNext;
+	else fiberById( f->lockPrev )->lockNext = f->lockNext;
+	if ( f->lockNext == -1 ) *tail = f->lockPrev;
+	else fiberById( f->lockNext )->lockPrev = f->lockPrev;
+}
+
+/* Removes the first fiber from a waiter list and wakes it. Needs the
+guard. Returns 0 if the list was empty. */
+static int wakeLockWaiter( int* head, int* tail )
+{
+	int id = *head;
+	if ( id == -1 ) return 0;
+	unqueueLockWaiter( head, tail, id );
+	atomic_store_explicit( &fiberById( id )->lockQueued, 0, memory_order_release );
+	fiberWakeup( id );
+	return 1;
+}
+
+/* Parks the calling fiber, which has just queued itself on a waiter list,
+until it is taken off the list. Returns LF_TIMEOUT if deadline passes first,
+after taking itself off. */
+static int waitForLock( atomic_flag* guard, int* head, int* tail, long long deadline )
+{
+	fiber* self = &sched->fiberList[ sched->currentFiber ];
+	while ( atomic_load_explicit( &self->lockQueued, memory_order_acquire ) )
+	{
+		if ( parkUntil( deadline ) == LF_TIMEOUT )
+		{
+			int timedOut;
+			lockGuard( guard );
+			timedOut = atomic_load_explicit( &self->lockQueued, memory_order_relaxed );
+			if ( timedOut )
 			{
-				fiberList[ currentFiber ] = fiberList[ numFibers ];
+				unqueueLockWaiter( head, tail, fiberSelf() );
+				atomic_store_explicit( &self->lockQueued, 0, memory_order_relaxed );
 			}
-			fiberList[ numFibers ].active = 0;
+			unlockGuard( guard );
+			/* Otherwise it was woken just in time */
+			if ( timedOut ) return LF_TIMEOUT;
 		}
-		
 	}
-	return;
+	return LF_NOERROR;
 }
 
-int spawnFiber( void (*func)(void) )
+void fiberRWLockInit( fiberRWLock* lock )
 {
-	if ( numFibers == MAX_FIBERS ) return LF_MAXFIBERS;
+	int i;
+	for ( i = 0; i < MAX_SHARDS; ++ i )
+	{
+		atomic_init( &lock->readers[i].count, 0 );
+	}
+	atomic_init( &lock->writer, 0 );
+	atomic_flag_clear( &lock->guard );
+	lock->drainingWriter = -1;
+	lock->readersHead = lock->readersTail = -1;
+	lock->writersHead = lock->writersTail = -1;
+}
 
-	/* Set the context to a newly allocated stack */
-	create_stack( &fiberList[numFibers], FIBER_STACK, func );
-	if ( fiberList[numFibers].stack_bottom == 0 )
+/* Lets the next waiters in once a writer is done or gave up. Needs the
+guard. Waiting writers go first; readers only once no writer waits. */
+static void releaseWriter( fiberRWLock* lock )
+{
+	lock->drainingWriter = -1;
+	atomic_store( &lock->writer, 0 );
+	if ( ! wakeLockWaiter( &lock->writersHead, &lock->writersTail ) )
 	{
-		LF_DEBUG_OUT( "Error: Could not allocate stack." );
-		return LF_MALLOCERROR;
+		while ( wakeLockWaiter( &lock->readersHead, &lock->readersTail ) ) {}
 	}
-	fiberList[numFibers].active = 1;
-	++ numFibers;
-	
+}
+
+int fiberReadLockUntil( fiberRWLock* lock, long long deadline )
+{
+	atomic_int* count;
+	/* Readers are counted by shard: see libfiber.h */
+	assert( sched != NULL );
+	count = &lock->readers[ sched->shard ].count;
+	if ( sched->inFiber ) deadline = earlierDeadline( deadline, fiberDeadline() );
+
+	for ( ;; )
+	{
+		/* The fast path only writes this shard's cache line */
+		atomic_fetch_add( count, 1 );
+		if ( ! atomic_load( &lock->writer ) ) return LF_NOERROR;
+
+		/* A writer holds the lock or is waiting for it: back out */
+		fiberReadUnlock( lock );
+		lockGuard( &lock->guard );
+		if ( ! atomic_load( &lock->writer ) )
+		{
+			unlockGuard( &lock->guard );
+			continue;
+		}
+		/* Only fibers can wait */
+		assert( sched->inFiber );
+		queueLockWaiter( &lock->readersHead, &lock->readersTail );
+		unlockGuard( &lock->guard );
+		if ( waitForLock( &lock->guard, &lock->readersHead, &lock->readersTail, deadline ) == LF_TIMEOUT )
+		{
+			return LF_TIMEOUT;
+		}
+	}
+}
+
+void fiberReadLock( fiberRWLock* lock )
+{
+	/* Without a deadline this does not fail */
+	fiberReadLockUntil( lock, 0 );
+}
+
+void fiberReadUnlock( fiberRWLock* lock )
+{
+	assert( sched != NULL );
+	if ( atomic_fetch_sub( &lock->readers[ sched->shard ].count, 1 ) == 1 &&
+		atomic_load( &lock->writer ) )
+	{
+		/* A writer may be waiting for the last reader to leave */
+		lockGuard( &lock->guard );
+		if ( lock->drainingWriter != -1 ) fiberWakeup( lock->drainingWriter );
+		unlockGuard( &lock->guard );
+	}
+}
+
+/* Returns the number of readers inside the lock, on every shard. */
+static int countReaders( fiberRWLock* lock )
+{
+	int readers = 0;
+	int i;
+	for ( i = 0; i < numShards; ++ i )
+	{
+		readers += atomic_load( &lock->readers[i].count );
+	}
+	return readers;
+}
+
+int fiberWriteLockUntil( fiberRWLock* lock, long long deadline )
+{
+	assert( sched != NULL && sched->inFiber );
+	deadline = earlierDeadline( deadline, fiberDeadline() );
+
+	lockGuard( &lock->guard );
+	while ( atomic_load( &lock->writer ) )
+	{
+		queueLockWaiter( &lock->writersHead, &lock->writersTail );
+		unlockGuard( &lock->guard );
+		if ( waitForLock( &lock->guard, &lock->writersHead, &lock->writersTail, deadline ) == LF_TIMEOUT )
+		{
+			return LF_TIMEOUT;
+		}
+		lockGuard( &lock->guard );
+	}
+	/* From here on new readers wait, so the writer only waits for the
+	readers already inside */
+	lock->drainingWriter = fiberSelf();
+	atomic_store( &lock->writer, 1 );
+	unlockGuard( &lock->guard );
+
+	while ( countReaders( lock ) != 0 )
+	{
+		if ( parkUntil( deadline ) == LF_TIMEOUT && countReaders( lock ) != 0 )
+		{
+			lockGuard( &lock->guard );
+			releaseWriter( lock );
+			unlockGuard( &lock->guard );
+			return LF_TIMEOUT;
+		}
+	}
+
+	lockGuard( &lock->guard );
+	lock->drainingWriter = -1;
+	unlockGuard( &lock->guard );
 	return LF_NOERROR;
 }
 
-int waitForAllFibers()
+void fiberWriteLock( fiberRWLock* lock )
 {
-	int fibersRemaining = 0;
-	
-	/* If we are in a fiber, wait for all the *other* fibers to quit */
-	if ( inFiber ) fibersRemaining = 1;
-	
-	LF_DEBUG_OUT1( "Waiting until there are only %d threads remaining...", fibersRemaining );
-	
-	/* Execute the fibers until they quit */
-	while ( numFibers > fibersRemaining )
+	fiberWriteLockUntil( lock, 0 );
+}
+
+void fiberWriteUnlock( fiberRWLock* lock )
+{
+	lockGuard( &lock->guard );
+	releaseWriter( lock );
+	unlockGuard( &lock->guard );
+}
+
+/* The number of lists fiberWait hashes addresses into */
+#define WAIT_BUCKETS 256
+
+/* Fibers waiting in fiberWait on the addresses that hash to one bucket */
+typedef struct
+{
+	_Alignas(64) atomic_flag guard;
+	int head;
+	int tail;
+} waitBucket;
+
+/* Initializers for empty buckets, since an empty list is -1, not 0 */
+#define WAIT_BUCKET_EMPTY { ATOMIC_FLAG_INIT, -1, -1 }
+#define WAIT_BUCKETS_EMPTY_4 WAIT_BUCKET_EMPTY, WAIT_BUCKET_EMPTY, WAIT_BUCKET_EMPTY, WAIT_BUCKET_EMPTY
+#define WAIT_BUCKETS_EMPTY_16 WAIT_BUCKETS_EMPTY_4, WAIT_BUCKETS_EMPTY_4, WAIT_BUCKETS_EMPTY_4, WAIT_BUCKETS_EMPTY_4
+#define WAIT_BUCKETS_EMPTY_64 WAIT_BUCKETS_EMPTY_16, WAIT_BUCKETS_EMPTY_16, WAIT_BUCKETS_EMPTY_16, WAIT_BUCKETS_EMPTY_16
+
+static waitBucket waitBuckets[ WAIT_BUCKETS ] = {
+	WAIT_BUCKETS_EMPTY_64, WAIT_BUCKETS_EMPTY_64, WAIT_BUCKETS_EMPTY_64, WAIT_BUCKETS_EMPTY_64
+};
+
+static waitBucket* bucketFor( const atomic_int* address )
+{
+	/* Fibonacci hashing: the top 8 bits of the product mix all the others
+	and pick one of the 256 buckets */
+	uint64_t hash = (uint64_t) (uintptr_t) address * 0x9e3779b97f4a7c15ULL;
+	return &waitBuckets[ hash >> 56 ];
+}
+
+int fiberWait( atomic_int* address, int expected, long long deadline )
+{
+	waitBucket* bucket = bucketFor( address );
+	assert( sched->inFiber );
+	deadline = earlierDeadline( deadline, fiberDeadline() );
+
+	lockGuard( &bucket->guard );
+	/* Checked under the guard, so a fiberWake after the change sees us */
+	if ( atomic_load( address ) != expected )
 	{
-		fiberYield();
+		unlockGuard( &bucket->guard );
+		return LF_NOERROR;
+	}
+	sched->fiberList[ sched->currentFiber ].waitAddress = address;
+	queueLockWaiter( &bucket->head, &bucket->tail );
+	unlockGuard( &bucket->guard );
+
+	return waitForLock( &bucket->guard, &bucket->head, &bucket->tail, deadline );
+}
+
+int fiberWake( atomic_int* address, int count )
+{
+	waitBucket* bucket = bucketFor( address );
+	int woken = 0;
+	int id;
+
+	lockGuard( &bucket->guard );
+	id = bucket->head;
+	while ( id != -1 && woken < count )
+	{
+		fiber* f = fiberById( id );
+		int next = f->lockNext;
+		/* Other addresses can share the bucket */
+		if ( f->waitAddress == address )
+		{
+			unqueueLockWaiter( &bucket->head, &bucket->tail, id );
+			atomic_store_explicit( &f->lockQueued, 0, memory_order_release );
+			fiberWakeup( id );
+			++ woken;
+		}
+		id = next;
+	}
+	unlockGuard( &bucket->guard );
+	return woken;
+}
+
+void fiberCounterInit( fiberCounter* counter )
+{
+	int i;
+	for ( i = 0; i < MAX_SHARDS; ++ i )
+	{
+		atomic_init( &counter->shards[i].value, 0 );
+	}
+}
+
+void fiberCounterAdd( fiberCounter* counter, long delta )
+{
+	atomic_long* value;
+	assert( sched != NULL );
+	value = &counter->shards[ sched->shard ].value;
+	/* Only this shard's thread writes its slot, so no locked instruction
+	is needed: other threads just have to see whole values */
+	atomic_store_explicit( value,
+		atomic_load_explicit( value, memory_order_relaxed ) + delta, memory_order_relaxed );
+}
+
+long fiberCounterRead( const fiberCounter* counter )
+{
+	long total = 0;
+	int i;
+	for ( i = 0; i < MAX_SHARDS; ++ i )
+	{
+		total += atomic_load_explicit( &counter->shards[i].value, memory_order_relaxed );
+	}
+	return total;
+}
+
+/* Arguments for shardMain */
+struct ShardArguments {
+	int shard;
+	int cpu;
+	void (*function)(void);
+	/* What the shard's waitForAllFibers returned */
+	int result;
+};
+
+/* Runs one shard: pins the thread, then runs fibers until they all quit. */
+static void* shardMain( void* arg )
+{
+	struct ShardArguments* arguments = (struct ShardArguments*) arg;
+	cpu_set_t cpus;
+
+	CPU_ZERO( &cpus );
+	CPU_SET( arguments->cpu, &cpus );
+	if ( pthread_setaffinity_np( pthread_self(), sizeof(cpus), &cpus ) )
+	{
+		LF_DEBUG_OUT1( "Could not pin shard to CPU %d; running unpinned.", arguments->cpu );
+	}
+
+	sched = shards[ arguments->shard ];
+	lf_yieldTarget.mainFiber = &sched->mainFiber;
+	arguments->result = spawnFiber( arguments->function );
+	if ( arguments->result == LF_NOERROR )
+	{
+		arguments->result = waitForAllFibers();
+	}
+	return NULL;
+}
+
+int runShards( int count, void (*func)(void) )
+{
+	struct ShardArguments arguments[ MAX_SHARDS ];
+	pthread_t threads[ MAX_SHARDS ];
+	cpu_set_t allowed;
+	int cpu = -1;
+	int started;
+	int i;
+	int result = LF_NOERROR;
+
+	if ( count < 1 || count > MAX_SHARDS ) return LF_MAXSHARDS;
+	/* shards[0] and the caller's sched belong to initFibers */
+	if ( sched != NULL || numShards != 0 ) return LF_INITIALIZED;
+
+	/* Create every scheduler before any shard can send to another */
+	for ( i = 0; i < count; ++ i )
+	{
+		shards[i] = newScheduler( i, count );
+		if ( shards[i] == NULL )
+		{
+			while ( i-- > 0 ) freeScheduler( shards[i] );
+			return LF_MALLOCERROR;
+		}
+	}
+	numShards = count;
+
+	/* Give each shard the next CPU this process may run on */
+	if ( sched_getaffinity( 0, sizeof(allowed), &allowed ) ) CPU_ZERO( &allowed );
+	for ( started = 0; started < count; ++ started )
+	{
+		if ( CPU_COUNT( &allowed ) > 0 )
+		{
+			do { cpu = (cpu + 1) % CPU_SETSIZE; } while ( ! CPU_ISSET( cpu, &allowed ) );
+		}
+		else cpu = started;
+
+		arguments[started].shard = started;
+		arguments[started].cpu = cpu;
+		arguments[started].function = func;
+		if ( pthread_create( &threads[started], NULL, &shardMain, &arguments[started] ) )
+		{
+			LF_DEBUG_OUT( "Error: pthread_create failed." );
+			result = LF_THREADERROR;
+			break;
+		}
+	}
+
+	for ( i = 0; i < started; ++ i )
+	{
+		pthread_join( threads[i], NULL );
+		if ( result == LF_NOERROR ) result = arguments[i].result;
+	}
+	for ( i = 0; i < count; ++ i )
+	{
+		freeScheduler( shards[i] );
+		shards[i] = NULL;
+	}
+	numShards = 0;
+	return result;
+}
+
+int fiberTraceStart( int sampleEvery )
+{
+	assert( sampleEvery >= 1 );
+	atomic_store( &traceSampleEvery, (unsigned int) sampleEvery );
+	traceStartTsc = __rdtsc();
+	clock_gettime( CLOCK_MONOTONIC, &traceStartTime );
+	atomic_store( &tracing, 1 );
+	return LF_NOERROR;
+}
+
+void fiberTraceStop()
+{
+	atomic_store( &tracing, 0 );
+}
+
+/* Writes one shard's events as Chrome trace events. Fibers are shown as
+threads (tid) of a process (pid) per shard. */
+static void dumpTraceRing( FILE* out, int shard, const traceRing* ring,
+	double ticksPerMicrosecond, int* first )
+{
+	static const char* const names[] = { "spawn", "run", "run", "park", "wake", "exit" };
+	static const char* const phases[] = { "i", "B", "E", "i", "i", "i" };
+	uint_fast64_t end = atomic_load_explicit( &ring->next, memory_order_acquire );
+	uint_fast64_t i = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+
+	fprintf( out, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"args\":{\"name\":\"shard %d\"}}", *first ? "" : ",", shard, shard );
+	*first = 0;
+
+	for ( ; i < end; ++ i )
+	{
+		const traceEvent* event = &ring->events[ i % TRACE_RING_SIZE ];
+		/* Events recorded before the last start would have a negative time */
+		if ( event->tsc < traceStartTsc ) continue;
+
+		fprintf( out, ",\n{\"name\":\"%s\",\"ph\":\"%s\",%s\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+			names[ event->type ], phases[ event->type ],
+			*phases[ event->type ] == 'i' ? "\"s\":\"t\"," : "",
+			(double) ( event->tsc - traceStartTsc ) / ticksPerMicrosecond,
+			shard, event->fiber );
+	}
+}
+
+int fiberTraceDump( const char* path )
+{
+	FILE* out;
+	struct timespec now;
+	uint64_t nowTsc = __rdtsc();
+	double microseconds;
+	double ticksPerMicrosecond = 1.0;
+	int first = 1;
+	int shard;
+
+	/* Calibrate the TSC against the time elapsed since tracing started */
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	microseconds = ( now.tv_sec - traceStartTime.tv_sec ) * 1e6 +
+		( now.tv_nsec - traceStartTime.tv_nsec ) / 1e3;
+	if ( microseconds > 0 && nowTsc > traceStartTsc )
+	{
+		ticksPerMicrosecond = (double) ( nowTsc - traceStartTsc ) / microseconds;
+	}
+
+	out = fopen( path, "w" );
+	if ( out == NULL )
+	{
+		LF_DEBUG_OUT1( "Error: Could not open trace file %s.", path );
+		return LF_IOERROR;
+	}
+
+	fprintf( out, "{\"traceEvents\":[" );
+	for ( shard = 0; shard < MAX_SHARDS; ++ shard )
+	{
+		if ( traceRings[shard] == NULL ) continue;
+		dumpTraceRing( out, shard, traceRings[shard], ticksPerMicrosecond, &first );
+	}
+	fprintf( out, "\n]}\n" );
+
+	if ( fclose( out ) )
+	{
+		LF_DEBUG_OUT1( "Error: Could not write trace file %s.", path );
+		return LF_IOERROR;
 	}
-	
 	return LF_NOERROR;
 }
 
+void fiberEnumerate( void (*visit)( const fiberInfo* info, void* arg ), void* arg )
+{
+	int i;
+	for ( i = 0; i < MAX_FIBERS; ++ i )
+	{
+		fiber* f = &sched->fiberList[i];
+		fiberInfo info;
+		if ( f->state == FIBER_FREE ) continue;
+
+		info.id = sched->shard * MAX_FIBERS + i;
+		if ( sched->inFiber && i == sched->currentFiber ) info.state = LF_FIBER_RUNNING;
+		else if ( f->state == FIBER_PARKED ) info.state = LF_FIBER_PARKED;
+		else info.state = LF_FIBER_RUNNABLE;
+		info.stackPointer = f->stack;
+#ifdef LF_SHARED_STACK
+		if ( f->stack == NULL )
+		{
+			info.stackLow = NULL;
+			info.stackHigh = NULL;
+		}
+		else
+		{
+			info.stackLow = sched->sharedStack;
+			info.stackHigh = (char*) sched->sharedStack + FIBER_STACK;
+		}
+#else
+		info.stackLow = f->stack_bottom;
+		info.stackHigh = f->stack_bottom == NULL ? NULL : (char*) f->stack_bottom + STACK_SIZE;
+#endif
+		visit( &info, arg );
+	}
+}
+
 /* Called when a fiber exits. */
 void fiber_exit() {
-	assert( inFiber );
-	assert( 0 <= currentFiber && currentFiber < numFibers );
-	fiberList[currentFiber].active = 0;
-	asm_switch( &mainFiber, &fiberList[currentFiber], 0 );
+	assert( sched->inFiber );
+	assert( 0 <= sched->currentFiber && sched->currentFiber < MAX_FIBERS );
+	sched->fiberList[sched->currentFiber].state = FIBER_EXITED;
+	lf_asm_switch( &sched->mainFiber, &sched->fiberList[sched->currentFiber], 0 );
 
-	/* asm_switch should never return for an exiting fiber. */
+	/* lf_asm_switch should never return for an exiting fiber. */
 	abort();
 }
 
@@ -137,15 +2115,39 @@ void fiber_exit() {
 #define ASM_PREFIX ""
 #endif
 
+#ifdef __x86_64
+#define ASM_RETURN_ADDRESS "rip"
+#else
+#define ASM_RETURN_ADDRESS "eip"
+#endif
+
+#ifdef __APPLE__
+#define ASM_FUNCTION( name )
+#define ASM_SIZE( name )
+#else
+#define ASM_FUNCTION( name ) "\t.type " name ", @function\n"
+#define ASM_SIZE( name ) "\t.size " name ", .-" name "\n"
+#endif
+
 /* Used to handle the correct stack alignment on Mac OS X, which requires a
 16-byte aligned stack. The process returns here from its "main" function,
 leaving the stack at 16-byte alignment. The call instruction then places a
 return address on the stack, making the stack correctly aligned for the
-process_exit function. */
+process_exit function.
+
+This is also the outermost frame of every fiber, so its CFI marks the
+return address as undefined, which makes debuggers and profilers stop
+unwinding here. Unwinders look up return address - 1, so the nop puts that
+address inside this function. */
 asm(".globl " ASM_PREFIX "asm_call_fiber_exit\n"
+ASM_FUNCTION( ASM_PREFIX "asm_call_fiber_exit" )
+"\t.cfi_startproc\n"
+"\t.cfi_undefined " ASM_RETURN_ADDRESS "\n"
+"\tnop\n"
 ASM_PREFIX "asm_call_fiber_exit:\n"
-/*"\t.type asm_call_fiber_exit, @function\n"*/
-"\tcall " ASM_PREFIX "fiber_exit\n");
+"\tcall " ASM_PREFIX "fiber_exit\n"
+"\t.cfi_endproc\n"
+ASM_SIZE( ASM_PREFIX "asm_call_fiber_exit" ));
 
 static void create_stack(fiber* fiber, int stack_size, void (*fptr)(void)) {
 	int i;
@@ -161,8 +2163,7 @@ static void create_stack(fiber* fiber, int stack_size, void (*fptr)(void)) {
 
 	/* Create a 16-byte aligned stack which will work on Mac OS X. */
 	assert(stack_size % 16 == 0);
-	fiber->stack_bottom = malloc(stack_size);
-	if (fiber->stack_bottom == 0) return;
+	assert(fiber->stack_bottom != NULL);
 	fiber->stack = (void**)((char*) fiber->stack_bottom + stack_size);
 #ifdef __APPLE__
 	assert((uintptr_t) fiber->stack % 16 == 0);
@@ -173,49 +2174,76 @@ static void create_stack(fiber* fiber, int stack_size, void (*fptr)(void)) {
 	*(--fiber->stack) = (void*) ((uintptr_t) &asm_call_fiber_exit);
 	/* 8 bytes below 16-byte alignment: will "return" to start this function */
 	*(--fiber->stack) = (void*) ((uintptr_t) fptr);  /* Cast to avoid ISO C warnings. */
-	/* push NULL words to initialize the registers loaded by asm_switch */
+	/* push NULL words to initialize the registers loaded by lf_asm_switch */
 	for (i = 0; i < NUM_REGISTERS; ++i) {
 		*(--fiber->stack) = 0;
 	}
 }
 
+/* The CFI describes the registers saved on the stack, so the caller's frame
+can be found at any instruction. After the stack pointer is swapped the
+next fiber's stack has the same layout, so the same CFI still applies. */
 #ifdef __x86_64
 /* arguments in rdi, rsi, rdx */
-asm(".globl " ASM_PREFIX "asm_switch\n"
-ASM_PREFIX "asm_switch:\n"
-#ifndef __APPLE__
-"\t.type asm_switch, @function\n"
-#endif
+asm(".globl " ASM_PREFIX "lf_asm_switch\n"
+ASM_FUNCTION( ASM_PREFIX "lf_asm_switch" )
+ASM_PREFIX "lf_asm_switch:\n"
+"\t.cfi_startproc\n"
 /* Move return value into rax */
 "\tmovq %rdx, %rax\n"
 
 /* save registers: rbx rbp r12 r13 r14 r15 (rsp into structure) */
 "\tpushq %rbx\n"
+"\t.cfi_adjust_cfa_offset 8\n"
+"\t.cfi_rel_offset rbx, 0\n"
 "\tpushq %rbp\n"
+"\t.cfi_adjust_cfa_offset 8\n"
+"\t.cfi_rel_offset rbp, 0\n"
 "\tpushq %r12\n"
+"\t.cfi_adjust_cfa_offset 8\n"
+"\t.cfi_rel_offset r12, 0\n"
 "\tpushq %r13\n"
+"\t.cfi_adjust_cfa_offset 8\n"
+"\t.cfi_rel_offset r13, 0\n"
 "\tpushq %r14\n"
+"\t.cfi_adjust_cfa_offset 8\n"
+"\t.cfi_rel_offset r14, 0\n"
 "\tpushq %r15\n"
+"\t.cfi_adjust_cfa_offset 8\n"
+"\t.cfi_rel_offset r15, 0\n"
 "\tmovq %rsp, (%rsi)\n"
 
 /* restore registers */
 "\tmovq (%rdi), %rsp\n"
 "\tpopq %r15\n"
+"\t.cfi_adjust_cfa_offset -8\n"
+"\t.cfi_restore r15\n"
 "\tpopq %r14\n"
+"\t.cfi_adjust_cfa_offset -8\n"
+"\t.cfi_restore r14\n"
 "\tpopq %r13\n"
+"\t.cfi_adjust_cfa_offset -8\n"
+"\t.cfi_restore r13\n"
 "\tpopq %r12\n"
+"\t.cfi_adjust_cfa_offset -8\n"
+"\t.cfi_restore r12\n"
 "\tpopq %rbp\n"
+"\t.cfi_adjust_cfa_offset -8\n"
+"\t.cfi_restore rbp\n"
 "\tpopq %rbx\n"
+"\t.cfi_adjust_cfa_offset -8\n"
+"\t.cfi_restore rbx\n"
 
 /* return to the "next" fiber with eax set to return_value */
-"\tret\n");
+"\tret\n"
+"\t.cfi_endproc\n"
+ASM_SIZE( ASM_PREFIX "lf_asm_switch" ));
 #else
-/* static int asm_switch(fiber* next, fiber* current, int return_value); */
-asm(".globl " ASM_PREFIX "asm_switch\n"
-ASM_PREFIX "asm_switch:\n"
-#ifndef __APPLE__
-"\t.type asm_switch, @function\n"
-#endif
+/* static int lf_asm_switch(fiber* next, fiber* current, int return_value); */
+asm(".globl " ASM_PREFIX "lf_asm_switch\n"
+ASM_FUNCTION( ASM_PREFIX "lf_asm_switch" )
+ASM_PREFIX "lf_asm_switch:\n"
+"\t.cfi_startproc\n"
 /* Move return value into eax, current pointer into ecx, next pointer into edx */
 "\tmov 12(%esp), %eax\n"
 "\tmov 8(%esp), %ecx\n"
@@ -223,18 +2251,36 @@ ASM_PREFIX "asm_switch:\n"
 
 /* save registers: ebx ebp esi edi (esp into structure) */
 "\tpush %ebx\n"
+"\t.cfi_adjust_cfa_offset 4\n"
+"\t.cfi_rel_offset ebx, 0\n"
 "\tpush %ebp\n"
+"\t.cfi_adjust_cfa_offset 4\n"
+"\t.cfi_rel_offset ebp, 0\n"
 "\tpush %esi\n"
+"\t.cfi_adjust_cfa_offset 4\n"
+"\t.cfi_rel_offset esi, 0\n"
 "\tpush %edi\n"
+"\t.cfi_adjust_cfa_offset 4\n"
+"\t.cfi_rel_offset edi, 0\n"
 "\tmov %esp, (%ecx)\n"
 
 /* restore registers */
 "\tmov (%edx), %esp\n"
 "\tpop %edi\n"
+"\t.cfi_adjust_cfa_offset -4\n"
+"\t.cfi_restore edi\n"
 "\tpop %esi\n"
+"\t.cfi_adjust_cfa_offset -4\n"
+"\t.cfi_restore esi\n"
 "\tpop %ebp\n"
+"\t.cfi_adjust_cfa_offset -4\n"
+"\t.cfi_restore ebp\n"
 "\tpop %ebx\n"
+"\t.cfi_adjust_cfa_offset -4\n"
+"\t.cfi_restore ebx\n"
 
 /* return to the "next" fiber with eax set to return_value */
-"\tret\n");
+"\tret\n"
+"\t.cfi_endproc\n"
+ASM_SIZE( ASM_PREFIX "lf_asm_switch" ));
 #endif
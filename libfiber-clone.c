@@ -1,7 +1,10 @@
-#include "libfiber.h"
-
 #define _GNU_SOURCE // required for clone
 
+#ifndef LF_BACKEND_CLONE
+#define LF_BACKEND_CLONE 1
+#endif
+#include "libfiber.h"
+
 #include <sched.h> /* For clone */
 #include <signal.h> /* For SIGCHLD */
 #include <stdlib.h>
@@ -0,0 +1,136 @@
+# gdb helpers for fibers of the asm backend (libfiber-asm.c) on x86-64.
+#
+# Load with: (gdb) source libfiber-gdb.py
+#
+#   info fibers      lists the fibers of every shard
+#   fiber bt ID      prints the backtrace of a fiber that is switched out
+#
+# A switched out fiber's stack pointer points at the registers saved by
+# lf_asm_switch, followed by the address it will return to. "fiber bt" loads
+# those into the registers of the selected thread, prints the backtrace, and
+# puts the thread's registers back. The process must be live (not a core).
+
+import struct
+
+import gdb
+
+# The order lf_asm_switch pops registers in
+SAVED_REGISTERS = ('r15', 'r14', 'r13', 'r12', 'rbp', 'rbx')
+STATE_NAMES = {1: 'runnable', 2: 'parked', 3: 'exited'}
+
+
+def schedulers():
+    """Yields (shard, scheduler) for each shard that has been set up."""
+    shards = gdb.parse_and_eval('shards')
+    count = int(gdb.parse_and_eval('numShards'))
+    for shard in range(count):
+        scheduler = shards[shard]
+        if int(scheduler) != 0:
+            yield shard, scheduler.dereference()
+
+
+def max_fibers(scheduler):
+    return scheduler['fiberList'].type.range()[1] + 1
+
+
+def has_field(value, name):
+    return any(field.name == name for field in value.type.fields())
+
+
+def fibers():
+    """Yields (id, scheduler, slot, fiber) for every live fiber."""
+    for shard, scheduler in schedulers():
+        slots = max_fibers(scheduler)
+        for slot in range(slots):
+            fiber = scheduler['fiberList'][slot]
+            if int(fiber['state']) != 0:
+                yield shard * slots + slot, scheduler, slot, fiber
+
+
+def is_running(scheduler, slot):
+    return int(scheduler['inFiber']) and int(scheduler['currentFiber']) == slot
+
+
+def copied_out(scheduler, slot):
+    """True if the fiber's frames are not on the shared stack right now."""
+    return has_field(scheduler, 'stackOwner') and int(scheduler['stackOwner']) != slot
+
+
+def saved_registers(fiber):
+    """Returns the registers a switched out fiber will resume with."""
+    sp = int(fiber['stack'])
+    count = len(SAVED_REGISTERS) + 1
+    memory = gdb.selected_inferior().read_memory(sp, 8 * count)
+    words = struct.unpack('<%dQ' % count, bytes(memory))
+    registers = dict(zip(SAVED_REGISTERS, words))
+    registers['rip'] = words[-1]
+    registers['rsp'] = sp + 8 * count
+    return registers
+
+
+class InfoFibers(gdb.Command):
+    """List the fibers of every shard: info fibers"""
+
+    def __init__(self):
+        super(InfoFibers, self).__init__('info fibers', gdb.COMMAND_STATUS)
+
+    def invoke(self, argument, from_tty):
+        for fiber_id, scheduler, slot, fiber in fibers():
+            if is_running(scheduler, slot):
+                where = 'running on its shard thread'
+            elif int(fiber['stack']) == 0:
+                where = 'not started'
+            elif copied_out(scheduler, slot):
+                where = 'stack copied out of the shared stack'
+            else:
+                where = str(gdb.parse_and_eval(
+                    '(void (*)(void)) %d' % saved_registers(fiber)['rip']))
+            print('%6d  %-9s  %s' % (fiber_id,
+                STATE_NAMES.get(int(fiber['state']), '?'), where))
+
+
+class FiberBacktrace(gdb.Command):
+    """Print the backtrace of a switched out fiber: fiber bt ID"""
+
+    def __init__(self):
+        super(FiberBacktrace, self).__init__('fiber bt', gdb.COMMAND_STACK)
+
+    def invoke(self, argument, from_tty):
+        wanted = int(gdb.parse_and_eval(argument))
+        for fiber_id, scheduler, slot, fiber in fibers():
+            if fiber_id != wanted:
+                continue
+            if is_running(scheduler, slot):
+                raise gdb.GdbError('fiber %d is running: use bt on its thread' % wanted)
+            if int(fiber['stack']) == 0:
+                raise gdb.GdbError('fiber %d has not started' % wanted)
+            if copied_out(scheduler, slot):
+                raise gdb.GdbError('fiber %d is copied out of the shared stack' % wanted)
+            self.backtrace(saved_registers(fiber))
+            return
+        raise gdb.GdbError('no fiber %d' % wanted)
+
+    def backtrace(self, registers):
+        gdb.execute('frame 0', to_string=True)
+        frame = gdb.selected_frame()
+        original = dict((name, int(frame.read_register(name)))
+            for name in registers)
+        try:
+            for name, value in registers.items():
+                gdb.execute('set $%s = %d' % (name, value))
+            gdb.execute('bt')
+        finally:
+            for name, value in original.items():
+                gdb.execute('set $%s = %d' % (name, value))
+
+
+class FiberPrefix(gdb.Command):
+    """Commands for libfiber fibers."""
+
+    def __init__(self):
+        super(FiberPrefix, self).__init__('fiber', gdb.COMMAND_STACK, prefix=True)
+
+
+InfoFibers()
+FiberPrefix()
+FiberBacktrace()
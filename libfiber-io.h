@@ -0,0 +1,26 @@
+#ifndef LIBFIBER_IO_H
+#define LIBFIBER_IO_H 1
+
+/* Kept apart from libfiber.h so that only code doing fiber I/O gets the
+socket headers, and the feature-test macros of the other backends still
+apply. Only the asm backend (libfiber-asm.c) implements these. */
+#include "libfiber.h"
+
+#include <sys/socket.h> /* For fiberAccept and fiberConnect */
+#include <sys/types.h> /* For ssize_t */
+
+/* Fiber I/O. These behave like the system calls of the same name on a
+non-blocking descriptor, except that instead of failing with EAGAIN they
+park the calling fiber until the descriptor is ready. Each shard watches
+the descriptors with its own epoll instance, checked whenever it runs out
+of runnable fibers and about once per pass over the run queue otherwise.
+One fiber may wait for a descriptor to be readable (fiberRead, fiberAccept)
+while another waits for it to be writable (fiberWrite, fiberConnect). A
+second fiber waiting for the same one fails with EBUSY. */
+extern ssize_t fiberRead( int fd, void* buf, size_t count );
+extern ssize_t fiberWrite( int fd, const void* buf, size_t count );
+/* The returned connection is non-blocking. */
+extern int fiberAccept( int fd, struct sockaddr* addr, socklen_t* addrlen );
+extern int fiberConnect( int fd, const struct sockaddr* addr, socklen_t addrlen );
+
+#endif
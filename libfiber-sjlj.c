@@ -1,8 +1,11 @@
-#include "libfiber.h"
-
-// required for sigaltstack and stack_t
+// required for sigaltstack and stack_t. Must come before any include.
 #define _XOPEN_SOURCE 500
 
+#ifndef LF_BACKEND_SJLJ
+#define LF_BACKEND_SJLJ 1
+#endif
+#include "libfiber.h"
+
 #include <assert.h>
 #include <setjmp.h>
 #include <signal.h>
@@ -33,24 +36,68 @@ static int numFibers = 0;
 /* The "main" execution context */
 jmp_buf	mainContext;
 
+/* All switches use _setjmp and _longjmp, which never save or restore the
+signal mask. On some platforms plain setjmp makes a system call for that. */
+
+/* Runs the current fiber's function, then switches back to main for good. */
+static void runFiber()
+{
+	LF_DEBUG_OUT1( "Starting fiber %d", currentFiber );
+	fiberList[currentFiber].function();
+	LF_DEBUG_OUT1( "Fiber %d finished, returning to main", currentFiber );
+	fiberList[currentFiber].active = 0;
+	_longjmp( mainContext, 1 );
+}
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+/* Where spawnFiber continues once the new stack has been set up */
+static jmp_buf spawnContext;
+
+/* The first function called on a new stack. It saves a context that starts
+the fiber, then jumps back to spawnFiber. */
+static void fiberBootstrap()
+{
+	if ( _setjmp( fiberList[numFibers].context ) )
+	{
+		/* We are being called again from the main context. Call the function */
+		runFiber();
+	}
+	_longjmp( spawnContext, 1 );
+}
+
+/* Calls fiberBootstrap with the stack pointer set to top. The top must be
+16-byte aligned; the call then leaves the stack as the ABI expects. */
+static void callOnStack( void* top )
+{
+#if defined(__x86_64__)
+	__asm__ volatile ( "movq %0, %%rsp\n\tcall *%1\n" : : "r" (top), "r" (&fiberBootstrap) : "memory" );
+#elif defined(__i386__)
+	__asm__ volatile ( "movl %0, %%esp\n\tcall *%1\n" : : "r" (top), "r" (&fiberBootstrap) : "memory" );
+#else
+	__asm__ volatile ( "mov sp, %0\n\tblr %1\n" : : "r" (top), "r" (&fiberBootstrap) : "memory" );
+#endif
+	/* fiberBootstrap leaves with _longjmp */
+	abort();
+}
+#else
+/* Other platforms create the stack by running a signal handler on it */
+#define LF_SIGNAL_BOOTSTRAP
+
 static void usr1handlerCreateStack( int signum )
 {
 	assert( signum == SIGUSR1 );
 	LF_DEBUG_OUT1( "Signal handler for fiber %d", numFibers );
 	
 	/* Save the current context, and return to terminate the signal handler scope */
-	if ( setjmp( fiberList[numFibers].context ) )
+	if ( _setjmp( fiberList[numFibers].context ) )
 	{
 		/* We are being called again from the main context. Call the function */
-		LF_DEBUG_OUT1( "Starting fiber %d", currentFiber );
-		fiberList[currentFiber].function();
-		LF_DEBUG_OUT1( "Fiber %d finished, returning to main", currentFiber );
-		fiberList[currentFiber].active = 0;
-		longjmp( mainContext, 1 );
+		runFiber();
 	}
 	
 	return;
 }
+#endif
 
 void initFibers()
 {
@@ -67,11 +114,12 @@ void initFibers()
 
 int spawnFiber( void (*func)(void) )
 {
+#ifdef LF_SIGNAL_BOOTSTRAP
 	struct sigaction handler;
 	struct sigaction oldHandler;
-	
-	stack_t stack;
 	stack_t oldStack;
+#endif
+	stack_t stack;
 	
 	if ( numFibers == MAX_FIBERS ) return LF_MAXFIBERS;
 	
@@ -91,6 +139,7 @@ int spawnFiber( void (*func)(void) )
 		VALGRIND_STACK_REGISTER(stack.ss_sp, ((char*) stack.ss_sp + FIBER_STACK));
 #endif
 
+#ifdef LF_SIGNAL_BOOTSTRAP
 	/* Install the new stack for the signal handler */
 	if ( sigaltstack( &stack, &oldStack ) )
 	{
@@ -120,6 +169,15 @@ int spawnFiber( void (*func)(void) )
 	/* Restore the original stack and handler */
 	sigaltstack( &oldStack, 0 );
 	sigaction( SIGUSR1, &oldHandler, 0 );
+#else
+	/* Start the fiber's stack directly: no system calls, and no signal
+	handler of the application gets replaced. malloc returns memory aligned
+	for any type, so the top is 16-byte aligned. */
+	if ( _setjmp( spawnContext ) == 0 )
+	{
+		callOnStack( (char*) stack.ss_sp + FIBER_STACK );
+	}
+#endif
 	
 	/* We now have an additional fiber, ready to roll */
 	fiberList[numFibers].active = 1;
@@ -136,7 +194,7 @@ void fiberYield()
 	if ( inFiber )
 	{
 		/* Store the current state */
-		if ( setjmp( fiberList[ currentFiber ].context ) )
+		if ( _setjmp( fiberList[ currentFiber ].context ) )
 		{
 			/* Returning via longjmp (resume) */
 			LF_DEBUG_OUT1( "Fiber %d resuming...", currentFiber );
@@ -145,7 +203,7 @@ void fiberYield()
 		{
 			LF_DEBUG_OUT1( "Fiber %d yielding the processor...", currentFiber );
 			/* Saved the state: Let's switch back to the main state */
-			longjmp( mainContext, 1 );
+			_longjmp( mainContext, 1 );
 		}
 	}
 	/* If we are in main, dispatch the next fiber */
@@ -154,7 +212,7 @@ void fiberYield()
 		if ( numFibers == 0 ) return;
 	
 		/* Save the current state */
-		if ( setjmp( mainContext ) )
+		if ( _setjmp( mainContext ) )
 		{
 			/* The fiber yielded the context to us */
 			inFiber = 0;
@@ -192,7 +250,7 @@ void fiberYield()
 			
 			LF_DEBUG_OUT1( "Switching to fiber %d", currentFiber );
 			inFiber = 1;
-			longjmp( fiberList[ currentFiber ].context, 1 );
+			_longjmp( fiberList[ currentFiber ].context, 1 );
 		}
 	}
 	
@@ -6,8 +6,12 @@ http://lists.apple.com/archives/darwin-dev/2008/Jan/msg00229.html */
 #define _XOPEN_SOURCE
 #endif
 
+#ifndef LF_BACKEND_UC
+#define LF_BACKEND_UC 1
+#endif
 #include "libfiber.h"
 
+#include <setjmp.h>
 #include <stdlib.h>
 #include <ucontext.h>
 
@@ -16,7 +20,13 @@ http://lists.apple.com/archives/darwin-dev/2008/Jan/msg00229.html */
 */
 typedef struct
 {
-	ucontext_t context; /* Stores the current context */
+	/* Stores the context saved by the fiber's last switch to main. */
+	jmp_buf jump;
+	/* The context created by makecontext. Fibers without LF_OWN_SIGMASK
+	free it as soon as they have started, and switch with jump from then
+	on. NULL once it is freed. */
+	ucontext_t* context;
+	int keepSignalMask; /* Set by LF_OWN_SIGMASK: always switch with swapcontext */
 	int active; /* A boolean flag, 0 if it is not active, 1 if it is */
 	/* Original stack pointer. On Mac OS X, stack_t.ss_sp is changed. */
 	void* stack; 
@@ -32,8 +42,16 @@ static int inFiber = 0;
 /* The number of active fibers */
 static int numFibers = 0;
 
-/* The "main" execution context */
+/* The "main" execution context, for fibers that switch with swapcontext */
 static ucontext_t mainContext;
+/* The "main" execution context, for fibers that switch with _longjmp */
+static jmp_buf mainJump;
+
+/* swapcontext saves and restores the signal mask, which is a system call
+on every switch. _setjmp and _longjmp only swap registers, so fibers use
+them unless they were spawned with LF_OWN_SIGMASK. A fiber is always
+entered the first time with swapcontext, since that is the only portable
+way to start a context built by makecontext. */
 
 /* Sets all the fibers to be initially inactive */
 void initFibers()
@@ -42,6 +60,7 @@ void initFibers()
 	for ( i = 0; i < MAX_FIBERS; ++ i )
 	{
 		fiberList[i].active = 0;
+		fiberList[i].context = 0;
 	}
 		
 	return;
@@ -53,22 +72,45 @@ void fiberYield()
 	/* If we are in a fiber, switch to the main process */
 	if ( inFiber )
 	{
+		fiber* self = &fiberList[currentFiber];
+
 		/* Switch to the main context */
 		LF_DEBUG_OUT1( "libfiber debug: Fiber %d yielding the processor...", currentFiber );
 	
-		swapcontext( &fiberList[currentFiber].context, &mainContext );
+		if ( self->keepSignalMask )
+		{
+			swapcontext( self->context, &mainContext );
+		}
+		else if ( _setjmp( self->jump ) == 0 )
+		{
+			_longjmp( mainJump, 1 );
+		}
 	}
 	/* Else, we are in the main process and we need to dispatch a new fiber */
 	else
 	{
+		fiber* next;
 		if ( numFibers == 0 ) return;
 	
 		/* Saved the state so call the next fiber */
 		currentFiber = (currentFiber + 1) % numFibers;
+		next = &fiberList[ currentFiber ];
 		
 		LF_DEBUG_OUT1( "Switching to fiber %d.", currentFiber );
 		inFiber = 1;
-		swapcontext( &mainContext, &fiberList[ currentFiber ].context );
+		/* Fibers come back either by returning from swapcontext or by
+		jumping to mainJump; both continue after this block. */
+		if ( _setjmp( mainJump ) == 0 )
+		{
+			if ( next->context != 0 )
+			{
+				swapcontext( &mainContext, next->context );
+			}
+			else
+			{
+				_longjmp( next->jump, 1 );
+			}
+		}
 		inFiber = 0;
 		LF_DEBUG_OUT1( "Fiber %d switched to main context.", currentFiber );
 		
@@ -77,6 +119,7 @@ void fiberYield()
 			LF_DEBUG_OUT1( "Fiber %d is finished. Cleaning up.\n", currentFiber );
 			/* Free the "current" fiber's stack */
 			free( fiberList[currentFiber].stack );
+			free( fiberList[currentFiber].context );
 			
 			/* Swap the last fiber with the current, now empty, entry */
 			-- numFibers;
@@ -85,6 +128,7 @@ void fiberYield()
 				fiberList[ currentFiber ] = fiberList[ numFibers ];
 			}
 			fiberList[ numFibers ].active = 0;		
+			fiberList[ numFibers ].context = 0;
 		}
 		
 	}
@@ -97,6 +141,12 @@ context of execution. */
 static void fiberStart( void (*func)(void) )
 {
 	fiberList[currentFiber].active = 1;
+	if ( ! fiberList[currentFiber].keepSignalMask )
+	{
+		/* swapcontext is done with it: switch with _longjmp from now on */
+		free( fiberList[currentFiber].context );
+		fiberList[currentFiber].context = 0;
+	}
 	func();
 	fiberList[currentFiber].active = 0;
 	
@@ -106,26 +156,41 @@ static void fiberStart( void (*func)(void) )
 
 int spawnFiber( void (*func)(void) )
 {
+	return spawnFiberWithFlags( func, 0 );
+}
+
+int spawnFiberWithFlags( void (*func)(void), int flags )
+{
+	ucontext_t* context;
 	if ( numFibers == MAX_FIBERS ) return LF_MAXFIBERS;
 	
 	/* Add the new function to the end of the fiber list */
-	getcontext( &fiberList[numFibers].context );
+	context = (ucontext_t*) malloc( sizeof(*context) );
+	if ( context == 0 )
+	{
+		LF_DEBUG_OUT( "Error: Could not allocate context." );
+		return LF_MALLOCERROR;
+	}
+	getcontext( context );
 
-	/* Set the context to a newly allocated stack */
-	fiberList[numFibers].context.uc_link = 0;
+	/* Set the context to a newly allocated stack */
+	context->uc_link = 0;
 	fiberList[numFibers].stack = malloc( FIBER_STACK );
-	fiberList[numFibers].context.uc_stack.ss_sp = fiberList[numFibers].stack;
-	fiberList[numFibers].context.uc_stack.ss_size = FIBER_STACK;
-	fiberList[numFibers].context.uc_stack.ss_flags = 0;
+	context->uc_stack.ss_sp = fiberList[numFibers].stack;
+	context->uc_stack.ss_size = FIBER_STACK;
+	context->uc_stack.ss_flags = 0;
 	
 	if ( fiberList[numFibers].stack == 0 )
 	{
 		LF_DEBUG_OUT( "Error: Could not allocate stack." );
+		free( context );
 		return LF_MALLOCERROR;
 	}
 	
 	/* Create the context. The context calls fiberStart( func ). */
-	makecontext( &fiberList[ numFibers ].context, (void (*)(void)) &fiberStart, 1, func );
+	makecontext( context, (void (*)(void)) &fiberStart, 1, func );
+	fiberList[numFibers].context = context;
+	fiberList[numFibers].keepSignalMask = ( flags & LF_OWN_SIGMASK ) != 0;
 	++ numFibers;
 	
 	return LF_NOERROR;
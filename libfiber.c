@@ -0,0 +1,12 @@
+/* Builds the whole library with the backend picked by LF_BACKEND_UC,
+LF_BACKEND_SJLJ, LF_BACKEND_CLONE or LF_BACKEND_ASM (the default), as
+libfiber.h describes. The backends still build on their own as well. */
+#if defined( LF_BACKEND_UC )
+#include "libfiber-uc.c"
+#elif defined( LF_BACKEND_SJLJ )
+#include "libfiber-sjlj.c"
+#elif defined( LF_BACKEND_CLONE )
+#include "libfiber-clone.c"
+#else
+#include "libfiber-asm.c"
+#endif
@@ -1,12 +1,26 @@
 #ifndef LIBFIBER_H
 #define LIBFIBER_H 1
 
+/* The backend is picked at compile time by defining one of LF_BACKEND_UC,
+LF_BACKEND_SJLJ, LF_BACKEND_CLONE or LF_BACKEND_ASM when building
+libfiber.c. Code using the library only needs to define LF_BACKEND_ASM, to
+inline fiberYield, and must then be linked with the asm backend. Without it
+every function is called out of line, so any backend can be linked. */
+
+#include <stdatomic.h> /* For fiberRWLock and fiberCounter */
+
 #define	LF_NOERROR	0
 #define	LF_MAXFIBERS	1
 #define LF_MALLOCERROR	2
 #define LF_CLONEERROR	3
 #define	LF_INFIBER	4
 #define LF_SIGNALERROR	5
+#define LF_MAXSHARDS	6
+#define LF_THREADERROR	7
+#define LF_QUEUEFULL	8
+#define LF_IOERROR	9
+#define LF_TIMEOUT	10
+#define LF_INITIALIZED	11
 
 /* Define a debugging output macro */
 #ifdef LF_DEBUG
@@ -22,24 +36,320 @@
 
 #endif
 
-/* The maximum number of fibers that can be active at once. */
+/* The maximum number of fibers that can be active at once. The asm backend
+allows defining it when building, to run many more. */
+#ifndef MAX_FIBERS
 #define MAX_FIBERS 10
-/* The size of the stack for each fiber. */
+#endif
+/* The size of the stack for each fiber. With LF_SHARED_STACK, the asm
+backend instead runs every fiber on one stack of this size, and a fiber's
+local variables may only be accessed by other fibers while it is running. */
 #define FIBER_STACK (1024*1024)
+/* With LF_STACK_ARENA, the asm backend packs stacks of ARENA_STACK bytes into
+one huge-page-backed region per scheduler instead. Note that these stacks
+are 64 KB, not FIBER_STACK. Fibers beyond the first ARENA_STACKS get
+malloc'ed stacks of the same size. The region holds the smaller of
+MAX_FIBERS and ARENA_STACKS stacks, each with a 4 KB gap below it: up to
+272 MB, reserved when the scheduler's first fiber runs. With explicit huge
+pages (MAP_HUGETLB) that much is taken from the huge page pool at once;
+otherwise it is address space, and each huge page becomes resident whole
+once a stack in it is touched. The gaps are not protected, so an overflow
+is only detected when the stack is released, after it has corrupted the
+stack below, and then the process aborts. */
+#define ARENA_STACK (64*1024)
+#define ARENA_STACKS 4096
+/* The maximum number of shards (scheduler threads) started by runShards. */
+#define MAX_SHARDS 64
+/* The number of messages buffered from one shard to another. */
+#define SHARD_RING_SIZE 256
+/* The number of accounting tags for spawnFiberTagged. */
+#define MAX_TAGS 16
 
 
-/* Should be called before executing any of the other functions. */
+/* Should be called before executing any of the other functions. With the
+asm backend, calling it again on the same thread does nothing and keeps the
+thread's fibers. The asm backend runs fibers on one thread this way: calling
+it on another thread, or while runShards runs, aborts. */
 extern void initFibers();
 
-/* Creates a new fiber, running the function that is passed as an argument. */
+/* Creates a new fiber, running the function that is passed as an argument.
+The asm backend allocates the stack when the fiber first runs instead, so
+there it fails only with LF_MAXFIBERS: see waitForAllFibers. */
 extern int spawnFiber( void (*func)(void) );
 
+/* Flags for spawnFiberWithFlags */
+/* Give the fiber its own signal mask, saved and restored on every switch. */
+#define LF_OWN_SIGMASK	1
+
+/* Like spawnFiber, with flags. Only the ucontext backend (libfiber-uc.c)
+implements this. Its fibers switch without a system call unless they are
+spawned with LF_OWN_SIGMASK. */
+extern int spawnFiberWithFlags( void (*func)(void), int flags );
+
+#ifdef LF_BACKEND_ASM
+/* The lf_ names below are internal to the asm backend, declared here only
+for the inline fiberYield. */
+
+/* The fibers fiberYield switches between on the calling thread. Maintained
+by the scheduler: do not modify. */
+typedef struct
+{
+	/* The context of the thread's main stack */
+	void* mainFiber;
+	/* The running fiber, or NULL when main is running */
+	void* currentFiber;
+} lf_yieldState;
+
+extern __thread lf_yieldState lf_yieldTarget;
+
+/* Saves the callee-saved registers on the current stack and its stack
+pointer in current, then resumes next. Implemented in assembly. */
+extern int lf_asm_switch( void* next, void* current, int return_value );
+
+/* Runs the next fiber until it switches back to main. */
+extern void lf_dispatch();
+
+/* Yield control to another execution context. Inline, so a yielding fiber
+makes one call, into lf_asm_switch. All the bookkeeping is done in main.
+The asm backend also defines it out of line, for code built without
+LF_BACKEND_ASM and for calls the compiler does not inline. */
+inline void fiberYield()
+{
+	if ( lf_yieldTarget.currentFiber != 0 )
+	{
+		lf_asm_switch( lf_yieldTarget.mainFiber, lf_yieldTarget.currentFiber, 0 );
+	}
+	else
+	{
+		lf_dispatch();
+	}
+}
+#else
 /* Yield control to another execution context. */
 extern void fiberYield();
+#endif
 
-/* Execute the fibers until they all quit. */
+/* Execute the fibers until they all quit. With the asm backend, a fiber
+whose stack cannot be allocated when it first runs is dropped without
+running, and this returns LF_MALLOCERROR (once) after such a failure. */
 extern int waitForAllFibers();
 
+/* The functions below are only implemented by the asm backend
+(libfiber-asm.c). A fiber is identified by a small integer id, which is
+unique across shards. */
+
+/* Like spawnFiber, but calls func( arg ). The fiber's stack is not
+allocated until it first runs, so spawning only records func and arg, and
+running out of memory is reported by waitForAllFibers. */
+extern int spawnFiberWithArg( void (*func)(void*), void* arg );
+
+/* Like spawnFiberWithArg, but charges the fiber's run time and stack memory
+to tag, between 0 and MAX_TAGS - 1. Fibers spawned any other way get the
+tag of the fiber that spawned them, or 0 when spawned from main. */
+extern int spawnFiberTagged( void (*func)(void*), void* arg, int tag );
+
+/* What the fibers with one tag use. */
+typedef struct
+{
+	/* The number of live fibers */
+	int fibers;
+	/* Time spent running, by fibers alive now or earlier. Switches are only
+	timed once spawnFiberTagged has been called on the shard. */
+	long long cpuNanoseconds;
+	/* The stack pages resident right now, sampled with mincore. With
+	LF_SHARED_STACK, the size of the fibers' saved frames instead. */
+	long long stackBytes;
+} fiberTagUsage;
+
+/* Fills usage for the calling shard's fibers with tag, for example to
+decide whether to admit more work of that kind. Sampling the stacks costs a
+system call per fiber, so call it periodically rather than per spawn. */
+extern int fiberGetTagUsage( int tag, fiberTagUsage* usage );
+
+/* Returns the id of the calling fiber, or -1 if called from main. */
+extern int fiberSelf();
+
+/* Blocks the calling fiber until fiberUnpark or fiberWakeup is called for it.
+Returns immediately if it was woken since it last parked. Wakeups can be
+spurious, so callers should park in a loop that checks their condition. */
+extern void fiberPark();
+
+/* Deadlines are absolute times in nanoseconds on the fiberNow clock, with 0
+meaning no deadline. Every fiber has a current deadline, which fibers it
+spawns and tasks it submits inherit. The waits that take a deadline end at
+the earlier of it and the current deadline. So do the fiber I/O calls,
+which fail with errno ETIMEDOUT. fiberPark and fiberShardReceive never time
+out. A wait that times out leaves nothing behind in wait queues or epoll. */
+
+/* Returns the current time in nanoseconds, from CLOCK_MONOTONIC. */
+extern long long fiberNow();
+
+/* Returns the calling fiber's current deadline. */
+extern long long fiberDeadline();
+
+/* Sets the calling fiber's current deadline, which may also extend it. */
+extern void fiberSetDeadline( long long deadline );
+
+/* Like fiberPark, but returns LF_TIMEOUT if the deadline passes first, and
+LF_NOERROR otherwise. */
+extern int fiberParkUntil( long long deadline );
+
+/* Makes a parked fiber runnable again. Must be called on the thread that runs
+the fibers, either from a fiber or from main. */
+extern void fiberUnpark( int fiber );
+
+/* Like fiberUnpark, but safe to call from any thread. The wakeup is queued
+and handled the next time the scheduler dispatches a fiber, waking the
+scheduler if every fiber is parked. */
+extern void fiberWakeup( int fiber );
+
+/* Runs count shards, each a scheduler thread pinned to its own CPU with its
+own fibers, and starts func as a fiber in every shard. Returns once all the
+fibers in all the shards have quit, with the first error a shard's
+waitForAllFibers returned. The shards replace the scheduler that
+initFibers creates, so it returns LF_INITIALIZED if initFibers was called.
+The calling thread cannot run fibers meanwhile. */
+extern int runShards( int count, void (*func)(void) );
+
+/* Returns the index of the calling shard, 0 after initFibers. */
+extern int fiberShard();
+
+/* Returns the number of shards. */
+extern int fiberShardCount();
+
+/* Sends a message to shard. Shards share nothing else, so this is how work
+moves between them. Returns LF_QUEUEFULL if the shard has SHARD_RING_SIZE
+unread messages from this shard. Message must not be NULL. */
+extern int fiberShardSend( int shard, void* message );
+
+/* Parks the calling fiber until a message arrives for this shard, then
+returns it. */
+extern void* fiberShardReceive();
+
+/* Like fiberShardReceive, but returns NULL if the deadline passes first. */
+extern void* fiberShardReceiveUntil( long long deadline );
+
+/* Starts workers fibers on the calling shard that run the tasks passed to
+fiberExecutorSubmit. Each worker runs tasks one after another and parks
+when there are none, so a task needs no fiber or stack of its own. */
+extern int fiberExecutorStart( int workers );
+
+/* Queues func( arg ) to run on one of this shard's workers, with the
+caller's current deadline. */
+extern int fiberExecutorSubmit( void (*func)(void*), void* arg );
+
+/* Makes the workers exit once the queued tasks have run. */
+extern void fiberExecutorStop();
+
+/* fiberRead, fiberWrite, fiberAccept and fiberConnect are declared in
+libfiber-io.h. */
+
+/* A reader/writer lock for fibers, which may be on any shard. Waiters park
+instead of spinning. Writers are preferred: once one is waiting, new readers
+wait too. Readers count themselves on their own shard's cache line, so
+reading while no writer is around writes no shared line. Initialize it with
+fiberRWLockInit. It is large (a cache line per shard), so share one lock
+rather than embedding one per object. Locking and unlocking must be done on
+a thread that runs fibers, one that called initFibers or a shard started by
+runShards, since readers count themselves by shard; only fibers can wait. */
+typedef struct
+{
+	struct
+	{
+		_Alignas(64) atomic_int count;
+	} readers[ MAX_SHARDS ];
+	/* Non-zero while a writer holds the lock or waits for readers to leave */
+	_Alignas(64) atomic_int writer;
+	/* A spin lock guarding the fields below */
+	atomic_flag guard;
+	/* The writer waiting for the readers to leave, or -1 */
+	int drainingWriter;
+	/* Waiting fibers, as lists of fiber ids */
+	int readersHead;
+	int readersTail;
+	int writersHead;
+	int writersTail;
+} fiberRWLock;
+
+extern void fiberRWLockInit( fiberRWLock* lock );
+extern void fiberReadLock( fiberRWLock* lock );
+extern void fiberReadUnlock( fiberRWLock* lock );
+extern void fiberWriteLock( fiberRWLock* lock );
+extern void fiberWriteUnlock( fiberRWLock* lock );
+/* Like fiberReadLock and fiberWriteLock, but return LF_TIMEOUT without
+the lock if the deadline passes first, and LF_NOERROR otherwise. */
+extern int fiberReadLockUntil( fiberRWLock* lock, long long deadline );
+extern int fiberWriteLockUntil( fiberRWLock* lock, long long deadline );
+
+/* Parks the calling fiber if *address still holds expected, until fiberWake
+is called for address or the deadline passes (see fiberParkUntil). Like a
+futex, but the waiters are kept in a hash table of lists in the process,
+so neither call enters the kernel unless a shard is asleep. Returns
+LF_NOERROR when woken or if *address did not hold expected, and LF_TIMEOUT
+otherwise. Callers check their condition again either way. */
+extern int fiberWait( atomic_int* address, int expected, long long deadline );
+
+/* Wakes up to count fibers waiting in fiberWait on address, from any
+thread. Returns the number woken. */
+extern int fiberWake( atomic_int* address, int count );
+
+/* A counter split across shards, for statistics updated far more often
+than they are read. Adding only writes the calling shard's cache line.
+Initialize it with fiberCounterInit. */
+typedef struct
+{
+	struct
+	{
+		_Alignas(64) atomic_long value;
+	} shards[ MAX_SHARDS ];
+} fiberCounter;
+
+extern void fiberCounterInit( fiberCounter* counter );
+/* Must be called on a thread that runs fibers, one that called initFibers
+or a shard started by runShards. */
+extern void fiberCounterAdd( fiberCounter* counter, long delta );
+/* Returns the sum of every shard's part. */
+extern long fiberCounterRead( const fiberCounter* counter );
+
+/* Starts recording spawn, switch, park, wake and exit events in a ring
+buffer per shard, timestamped with the TSC. Only the events of one in every
+sampleEvery fibers, picked in spawn order, are recorded, so a trace can be
+left on in production at a small cost; 1 records every fiber. While tracing
+is stopped the scheduler only pays for a flag check. */
+extern int fiberTraceStart( int sampleEvery );
+
+/* Stops recording events. Recorded events are kept until the next start. */
+extern void fiberTraceStop();
+
+/* Writes the most recent events of every shard to path in the Chrome
+trace-event JSON format, which chrome://tracing and Perfetto can open. Call
+it when other shards are not running, for example after runShards returns. */
+extern int fiberTraceDump( const char* path );
+
+/* Values for fiberInfo.state */
+#define LF_FIBER_RUNNING	0
+#define LF_FIBER_RUNNABLE	1
+#define LF_FIBER_PARKED	2
+
+/* Describes one fiber for fiberEnumerate. */
+typedef struct
+{
+	int id;
+	int state;
+	/* The stack pointer saved when the fiber last switched out. Unwinding
+	from here (see libfiber-gdb.py) gives the fiber's backtrace. It is not
+	meaningful for the running fiber, and NULL if the fiber has not run. */
+	void* stackPointer;
+	/* The bounds of the fiber's stack, NULL if the fiber has not run. With
+	LF_SHARED_STACK this is the shared stack, which only holds the fiber's
+	frames if it ran last. */
+	void* stackLow;
+	void* stackHigh;
+} fiberInfo;
+
+/* Calls visit once for every fiber of the calling thread's shard. */
+extern void fiberEnumerate( void (*visit)( const fiberInfo* info, void* arg ), void* arg );
+
 /* Define VALGRIND to include valgrind specific code */
 #ifdef VALGRIND
 #include <valgrind/valgrind.h>